@@ -4,9 +4,373 @@
 #include <cstdlib> 
 #include <ctime> // For time()
 #include <iomanip> 
+#include <cmath>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <memory>
+#include <random>
+#include <cstdint>
+#include <unordered_map>
+#include <functional>
+#include <mutex>
+#include <chrono>
+#include <deque>
+#include <string_view>
+#include <charconv>
+#include <stdexcept>
+#include <fstream>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <csignal>
+#include <cerrno>
+#include <cstdio>
+#include <new>
+#include <coroutine>
+#include <condition_variable>
+#include <utility>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 namespace StockSim { // Namespace to encapsulate stock simulation classes
 using namespace std;
 
+#define STOCKSIM_CONCAT_INNER(a, b) a##b
+#define STOCKSIM_CONCAT(a, b) STOCKSIM_CONCAT_INNER(a, b) // Unique local names for the scoped macros
+
+#ifndef STOCKSIM_NO_METRICS // Define STOCKSIM_NO_METRICS to compile all instrumentation out
+
+enum class Metric : uint8_t { UpdatePrice, BuyStock, SellStock, UpdatePrices, Render, Count }; // Instrumented operations
+
+class MetricsRegistry { // Per-thread call counters and latency histograms, summed when read
+private:
+    static constexpr size_t bucketCount = 1024; // Log-linear buckets, 16 per power of two (about 6% resolution)
+    static constexpr size_t metricCount = (size_t)Metric::Count;
+
+    struct ThreadMetrics { // Written only by its own thread, read by the exporter
+        atomic<uint64_t> totalNanos[metricCount] = {};
+        atomic<uint64_t> buckets[metricCount][bucketCount] = {};
+    };
+
+    mutex lock; // Guards threads and spare, taken when a thread starts or exits
+    vector<unique_ptr<ThreadMetrics>> threads; // Every block ever handed out, at most one per concurrently running thread
+    vector<ThreadMetrics*> spare; // Blocks of exited threads, the next new thread keeps counting into one
+
+    struct Lease { // Gives the block back when its thread exits
+        ThreadMetrics* block = nullptr;
+        ~Lease() {
+            if (block) MetricsRegistry::instance().release(block);
+        }
+    };
+
+    static size_t bucketOf(uint64_t nanos) {
+        if (nanos < 16) return nanos;
+        int msb = 63 - __builtin_clzll(nanos);
+        return (msb - 3) * 16 + ((nanos >> (msb - 4)) & 15);
+    }
+
+    static uint64_t bucketLimit(size_t bucket) { // Largest value falling into a bucket
+        if (bucket < 16) return bucket;
+        int msb = bucket / 16 + 3;
+        return ((16 + bucket % 16 + 1) << (msb - 4)) - 1;
+    }
+
+    static const char* metricName(size_t m) {
+        static const char* names[] = {"update_price", "buy_stock", "sell_stock", "update_prices", "render"};
+        return names[m];
+    }
+
+    ThreadMetrics& local() {
+        thread_local Lease mine;
+        if (!mine.block) {
+            lock_guard<mutex> guard(lock);
+            if (!spare.empty()) { // Counts of the exited thread stay in the block, the mutex orders the hand-over
+                mine.block = spare.back();
+                spare.pop_back();
+            } else {
+                threads.push_back(make_unique<ThreadMetrics>());
+                mine.block = threads.back().get();
+            }
+        }
+        return *mine.block;
+    }
+
+    void release(ThreadMetrics* block) {
+        lock_guard<mutex> guard(lock);
+        spare.push_back(block);
+    }
+
+    struct Summary { uint64_t count = 0, totalNanos = 0; vector<uint64_t> buckets = vector<uint64_t>(bucketCount); };
+
+    Summary summarize(size_t m) {
+        Summary s;
+        lock_guard<mutex> guard(lock);
+        for (const auto& t : threads) {
+            s.totalNanos += t->totalNanos[m].load(memory_order_relaxed);
+            for (size_t b = 0; b < bucketCount; ++b) {
+                uint64_t c = t->buckets[m][b].load(memory_order_relaxed);
+                s.buckets[b] += c;
+                s.count += c;
+            }
+        }
+        return s;
+    }
+
+    static uint64_t quantile(const Summary& s, double q) {
+        uint64_t rank = (uint64_t)(q * (s.count - 1)), seen = 0;
+        for (size_t b = 0; b < bucketCount; ++b)
+            if ((seen += s.buckets[b]) > rank) return bucketLimit(b);
+        return 0;
+    }
+
+public:
+    static MetricsRegistry& instance() {
+        static MetricsRegistry registry;
+        return registry;
+    }
+
+    void record(Metric metric, uint64_t nanos) { // Relaxed load/store pairs, each counter has a single writer
+        ThreadMetrics& t = local();
+        auto& total = t.totalNanos[(size_t)metric];
+        auto& bucket = t.buckets[(size_t)metric][bucketOf(nanos)];
+        total.store(total.load(memory_order_relaxed) + nanos, memory_order_relaxed);
+        bucket.store(bucket.load(memory_order_relaxed) + 1, memory_order_relaxed);
+    }
+
+    void dumpText(ostream& os) { // Human readable summary
+        os << "metric          count     mean_ns      p50_ns      p99_ns      max_ns\n";
+        for (size_t m = 0; m < metricCount; ++m) {
+            Summary s = summarize(m);
+            if (s.count == 0) continue;
+            size_t top = bucketCount - 1;
+            while (s.buckets[top] == 0) --top;
+            os << left << setw(14) << metricName(m) << right << setw(7) << s.count << setw(12) << s.totalNanos / s.count
+               << setw(12) << quantile(s, 0.5) << setw(12) << quantile(s, 0.99) << setw(12) << bucketLimit(top) << "\n";
+        }
+    }
+
+    void writePrometheus(ostream& os) { // Text exposition format, one histogram per metric with power-of-two bounds
+        for (size_t m = 0; m < metricCount; ++m) {
+            Summary s = summarize(m);
+            string name = string("stocksim_") + metricName(m) + "_seconds";
+            os << "# TYPE " << name << " histogram\n";
+            uint64_t cumulative = 0;
+            for (size_t b = 0; b < bucketCount; ++b) {
+                cumulative += s.buckets[b];
+                if (b < 15 || b % 16 != 15) continue; // Emit at the end of each power of two
+                os << name << "_bucket{le=\"" << (bucketLimit(b) + 1) * 1e-9 << "\"} " << cumulative << "\n";
+                if (cumulative == s.count) break;
+            }
+            os << name << "_bucket{le=\"+Inf\"} " << s.count << "\n";
+            os << name << "_sum " << s.totalNanos * 1e-9 << "\n";
+            os << name << "_count " << s.count << "\n";
+        }
+    }
+};
+
+class ScopedTimer { // Records the lifetime of a scope into the metrics registry
+private:
+    Metric metric;
+    chrono::steady_clock::time_point start;
+
+public:
+    explicit ScopedTimer(Metric metric) : metric(metric), start(chrono::steady_clock::now()) {}
+    ~ScopedTimer() {
+        auto nanos = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+        MetricsRegistry::instance().record(metric, nanos > 0 ? nanos : 0);
+    }
+};
+
+#define STOCKSIM_TIMED(metric) ::StockSim::ScopedTimer STOCKSIM_CONCAT(stocksimTimer, __LINE__)(::StockSim::Metric::metric)
+#else
+#define STOCKSIM_TIMED(metric) ((void)0)
+#endif
+
+#ifndef STOCKSIM_NO_TRACE // Define STOCKSIM_NO_TRACE to compile all trace spans out
+
+class TraceRecorder { // Timeline of scoped spans in per-thread append-only buffers, exported as Chrome trace JSON
+private:
+    struct Event {
+        const char* name; // String literal naming the phase
+        uint64_t start, duration; // Nanoseconds since the recorder was created
+    };
+
+    struct Chunk { // Filled by one thread, read concurrently up to `used`
+        static constexpr size_t capacity = 4096;
+        Event events[capacity];
+        atomic<size_t> used{0};
+        atomic<Chunk*> next{nullptr};
+    };
+
+    struct ThreadBuffer {
+        Chunk* head = new Chunk; // First chunk, read by the exporter
+        Chunk* tail = head; // Chunk being filled, touched only by the current owner thread
+        uint32_t tid; // Small thread number for the viewer
+        bool main = false; // Owned by the thread that enabled tracing
+        ~ThreadBuffer() {
+            for (Chunk* c = head; c;) { Chunk* next = c->next.load(memory_order_relaxed); delete c; c = next; }
+        }
+    };
+
+    struct Lease { // Gives the buffer back when its thread exits, its events stay in the trace
+        ThreadBuffer* buffer = nullptr;
+        ~Lease() {
+            if (buffer) TraceRecorder::instance().release(buffer);
+        }
+    };
+
+    atomic<bool> enabled{false}; // Spans cost one relaxed load while disabled
+    chrono::steady_clock::time_point origin = chrono::steady_clock::now();
+    thread::id mainThread; // Set by enable()
+    mutex lock; // Guards buffers and spare, taken when a thread starts or exits and when exporting
+    vector<unique_ptr<ThreadBuffer>> buffers; // At most one per concurrently recording thread
+    vector<ThreadBuffer*> spare; // Worker buffers of exited threads, reused by the next worker
+
+    ThreadBuffer& local() {
+        thread_local Lease mine;
+        if (!mine.buffer) {
+            bool isMain = this_thread::get_id() == mainThread;
+            lock_guard<mutex> guard(lock);
+            if (!isMain && !spare.empty()) { // Later workers continue on the lane of an exited one
+                mine.buffer = spare.back();
+                spare.pop_back();
+            } else {
+                buffers.push_back(make_unique<ThreadBuffer>());
+                mine.buffer = buffers.back().get();
+                mine.buffer->tid = (uint32_t)buffers.size();
+                mine.buffer->main = isMain;
+            }
+        }
+        return *mine.buffer;
+    }
+
+    void release(ThreadBuffer* buffer) {
+        lock_guard<mutex> guard(lock);
+        if (!buffer->main) spare.push_back(buffer);
+    }
+
+public:
+    static TraceRecorder& instance() {
+        static TraceRecorder recorder;
+        return recorder;
+    }
+
+    void enable(bool on = true) { // The calling thread is labelled main in the trace
+        mainThread = this_thread::get_id();
+        enabled.store(on, memory_order_relaxed);
+    }
+    bool isEnabled() const { return enabled.load(memory_order_relaxed); }
+
+    uint64_t now() const {
+        return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - origin).count();
+    }
+
+    void record(const char* name, uint64_t start, uint64_t end) { // Lock-free append by the owning thread
+        ThreadBuffer& b = local();
+        size_t used = b.tail->used.load(memory_order_relaxed);
+        if (used == Chunk::capacity) { // Start a new chunk and link it for the exporter
+            Chunk* fresh = new Chunk;
+            b.tail->next.store(fresh, memory_order_release);
+            b.tail = fresh;
+            used = 0;
+        }
+        b.tail->events[used] = {name, start, end - start};
+        b.tail->used.store(used + 1, memory_order_release); // Publish the event
+    }
+
+    void writeChromeTrace(ostream& os) { // Events published so far, safe while other threads keep recording
+        lock_guard<mutex> guard(lock);
+        os << fixed << setprecision(3); // Microseconds down to the nanosecond, default precision rounds long sessions to 10us or worse
+        os << "{\"traceEvents\":[\n";
+        bool first = true;
+        for (const auto& b : buffers) {
+            os << (first ? "" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << b->tid
+               << ",\"args\":{\"name\":\"" << (b->main ? "main" : "worker " + to_string(b->tid)) << "\"}}";
+            first = false;
+            for (Chunk* c = b->head; c; c = c->next.load(memory_order_acquire)) {
+                size_t used = c->used.load(memory_order_acquire);
+                for (size_t i = 0; i < used; ++i) {
+                    const Event& e = c->events[i];
+                    os << ",\n{\"name\":\"" << e.name << "\",\"cat\":\"stocksim\",\"ph\":\"X\",\"pid\":1,\"tid\":" << b->tid
+                       << ",\"ts\":" << e.start / 1000.0 << ",\"dur\":" << e.duration / 1000.0 << "}";
+                }
+            }
+        }
+        os << "\n]}\n";
+    }
+};
+
+class TraceSpan { // Records its scope as one complete event when tracing is enabled
+private:
+    const char* name;
+    uint64_t start = 0;
+
+public:
+    explicit TraceSpan(const char* name) : name(name) {
+        if (TraceRecorder::instance().isEnabled()) start = TraceRecorder::instance().now();
+        else this->name = nullptr;
+    }
+    ~TraceSpan() {
+        if (name) TraceRecorder::instance().record(name, start, TraceRecorder::instance().now());
+    }
+};
+
+#define STOCKSIM_TRACE(name) ::StockSim::TraceSpan STOCKSIM_CONCAT(stocksimSpan, __LINE__)(name)
+#else
+#define STOCKSIM_TRACE(name) ((void)0)
+#endif
+
+struct VolatilityProfile { // Daily volatility of each risk level
+    double low = 0.05, medium = 0.1, high = 0.2;
+
+    static uint8_t riskIndex(string_view risk) { return (risk == "High") ? 2 : (risk == "Medium") ? 1 : 0; }
+    static string riskName(uint8_t index) { return index == 2 ? "High" : index == 1 ? "Medium" : "Low"; }
+
+    double forIndex(uint8_t index) const { return index == 2 ? high : index == 1 ? medium : low; }
+    double forRisk(const string& risk) const { return forIndex(riskIndex(risk)); }
+};
+
+class Fixed { // Fixed-point amount stored as a whole number of 1e-4 ticks, exact to add and compare
+private:
+    int64_t ticks = 0;
+
+public:
+    static constexpr int64_t scale = 10000; // Ticks per unit
+
+    constexpr Fixed() {}
+    static constexpr Fixed fromTicks(int64_t ticks) { Fixed f; f.ticks = ticks; return f; }
+    static Fixed fromDouble(double value) { return fromTicks(llround(value * scale)); } // Rounds to the nearest tick
+
+    constexpr int64_t getTicks() const { return ticks; }
+    constexpr double toDouble() const { return (double)ticks / scale; }
+
+    constexpr Fixed operator+(Fixed other) const { return fromTicks(ticks + other.ticks); }
+    constexpr Fixed operator-(Fixed other) const { return fromTicks(ticks - other.ticks); }
+    constexpr Fixed operator*(int64_t quantity) const { return fromTicks(ticks * quantity); }
+    Fixed scaled(int64_t numerator, int64_t denominator) const { // this * numerator / denominator, rounded half away from zero
+        __int128 product = (__int128)ticks * numerator;
+        __int128 half = denominator / 2;
+        return fromTicks((int64_t)((product >= 0 ? product + half : product - half) / denominator));
+    }
+    Fixed& operator+=(Fixed other) { ticks += other.ticks; return *this; }
+    Fixed& operator-=(Fixed other) { ticks -= other.ticks; return *this; }
+    constexpr auto operator<=>(const Fixed&) const = default;
+
+    friend ostream& operator<<(ostream& os, Fixed value) { return os << value.toDouble(); }
+};
+
+using Money = Fixed; // Cash amounts
+using Price = Fixed; // Prices per share, Price * quantity gives Money
+
 class Stock { // Base class for all stocks(abstract)
 protected:  
     int id; // Unique identifier for the stock
@@ -15,151 +379,3894 @@ protected:
     string riskLevel; // Risk level of the stock (Low, Medium, High)
 
 public:
-    Stock(int id, string name, double price, string risk) // Constructor to initialize stock attributes
-        : id(id), name(name), currentPrice(price), riskLevel(risk) {} 
+    Stock(int id, string name, double price, string risk) // Constructor to initialize stock attributes
+        : id(id), name(name), currentPrice(price), riskLevel(risk) {} 
+
+    virtual ~Stock() {} // Virtual destructor for proper cleanup of derived classes
+
+    virtual void updatePrice() = 0; // Pure virtual function to update stock price, must be implemented by derived classes
+
+    string getName() const { return name; } // Getter for stock name
+    double getPrice() const { return currentPrice; } // Getter for current price
+    string getRiskLevel() const { return riskLevel; } // Getter for risk level
+    int getId() const { return id; } // Getter for stock ID
+
+   
+    void setPrice(double price) { currentPrice = price; } // Setter for current price
+
+    virtual void display() const { displayQuote(currentPrice); } // Display stock information
+
+    void displayQuote(double price) const { // Display stock information at a given price, e.g. from a snapshot
+        cout << setw(2) << id << ". " << setw(12) << name  // Display stock name
+             << " | $" << setw(8) << fixed << setprecision(2) << price  // Display current price
+             << " | Risk: " << riskLevel; // Display risk level
+    }
+
+    friend ostream& operator<<(ostream& os, const Stock& stock) { // Overloaded operator to print stock information
+        os << stock.name << " ($" << stock.currentPrice << ", " << stock.riskLevel << ")"; // Output format
+        return os;
+    }
+};
+
+class SimulatedStock : public Stock { // Derived class for simulated stocks
+protected:
+    vector<double> priceHistory; // Vector to store price history for the stock
+    vector<size_t> actionAt; // History length when each corporate action happened, earlier entries are adjusted by it
+    vector<double> actionProduct; // Running product of the adjustment factors, one per action
+
+    void addAdjustment(double factor) { // O(1), history is only rescaled when read
+        actionAt.push_back(priceHistory.size());
+        actionProduct.push_back((actionProduct.empty() ? 1.0 : actionProduct.back()) * factor);
+    }
+
+public:
+    SimulatedStock(int id, std::string name, double price, std::string risk) // Constructor to initialize simulated stock attributes
+        : Stock(id, name, price, risk) { // Call base class constructor
+        priceHistory.push_back(price); // Initialize price history with the current price
+    }
+
+    double volatility(const VolatilityProfile& profile = VolatilityProfile()) const { // Volatility based on risk level
+        return profile.forRisk(riskLevel);
+    }
+
+    void updatePrice() override { // Override to update stock price based on risk level
+        STOCKSIM_TIMED(UpdatePrice);
+        applyReturn(((rand() % 201) - 100) / 100.0 * volatility()); // Random move scaled by volatility
+    }
+
+    void applyReturn(double relativeChange) { // Move the price by a relative change and record it in history
+        double change = relativeChange * currentPrice; // Calculate price change from the relative move
+        currentPrice += change; // Update current price with the calculated change
+        if (currentPrice < 1) currentPrice = 1; // Ensure price does not go below 1
+        priceHistory.push_back(currentPrice); // Add new price to history
+    }
+
+    void recordPrice(double price) { // Set the next price from an external source, e.g. a replay
+        currentPrice = price;
+        priceHistory.push_back(price);
+    }
+
+    const vector<double>& getHistory() const { return priceHistory; } // Getter for price history, as recorded
+
+    void applySplit(double ratio) { // ratio new shares per old share, e.g. 2 for a 2-for-1 split
+        currentPrice /= ratio;
+        addAdjustment(1.0 / ratio);
+    }
+
+    void applyDividend(double amount) { // Price goes ex-dividend, earlier prices scale by the drop so returns stay total returns
+        double before = currentPrice;
+        currentPrice = max(currentPrice - amount, 1.0);
+        addAdjustment(currentPrice / before);
+    }
+
+    double adjustmentFactor(size_t i) const { // Product of the factors of every action after history entry i
+        if (actionAt.empty() || i >= actionAt.back()) return 1.0;
+        size_t before = upper_bound(actionAt.begin(), actionAt.end(), i) - actionAt.begin(); // Actions already reflected in entry i
+        return before ? actionProduct.back() / actionProduct[before - 1] : actionProduct.back();
+    }
+
+    double adjustedPrice(size_t i) const { return priceHistory[i] * adjustmentFactor(i); } // Comparable with the current price
+
+    void display() const override { // Override to display stock information along with price history
+        Stock::display(); // Call base class display method
+        cout << " | Day " << priceHistory.size(); // Display the current day based on price history size
+    }
+};
+
+enum class LotRelief { Fifo, Lifo }; // Which tax lots a sale relieves first
+
+struct TaxLot { // 16 bytes
+    uint32_t id; // Acquisition order within the portfolio
+    int32_t quantity; // Shares still held, 0 once relieved out of order
+    int64_t cost; // Price per share in ticks
+};
+
+class LotPool { // Fixed-size chunks of tax lots shared by every position of a portfolio, recycled through a free list
+public:
+    static constexpr size_t lotsPerChunk = 64;
+    static constexpr uint32_t none = UINT32_MAX; // End of a chunk chain
+
+    struct Chunk {
+        TaxLot lots[lotsPerChunk];
+        uint32_t prev, next; // Neighbours in the owning queue, next links the free list
+    };
+
+private:
+    deque<Chunk> chunks; // Grows without moving chunks already handed out
+    uint32_t freeList = none;
+    size_t inUse = 0;
+    uint32_t lastId = 0;
+
+public:
+    uint32_t allocate() {
+        uint32_t c = freeList;
+        if (c != none) freeList = chunks[c].next;
+        else { c = (uint32_t)chunks.size(); chunks.emplace_back(); }
+        chunks[c].prev = chunks[c].next = none;
+        ++inUse;
+        return c;
+    }
+
+    void release(uint32_t c) {
+        chunks[c].next = freeList;
+        freeList = c;
+        --inUse;
+    }
+
+    Chunk& operator[](uint32_t c) { return chunks[c]; }
+    const Chunk& operator[](uint32_t c) const { return chunks[c]; }
+
+    uint32_t nextId() { return ++lastId; }
+    size_t chunksInUse() const { return inUse; }
+    size_t chunksAllocated() const { return chunks.size(); }
+};
+
+class LotQueue { // Tax lots of one position in acquisition order, a deque of pooled chunks
+private:
+    static constexpr uint32_t none = LotPool::none;
+    uint32_t head = none, tail = none;
+    uint32_t begin = 0, end = 0; // First live slot in the head chunk, one past the last in the tail chunk
+
+    TaxLot& front(LotPool& pool) { return pool[head].lots[begin]; }
+    TaxLot& back(LotPool& pool) { return pool[tail].lots[end - 1]; }
+
+    void popFront(LotPool& pool) {
+        ++begin;
+        if (head == tail && begin == end) { reset(pool); return; }
+        if (begin == LotPool::lotsPerChunk) {
+            uint32_t next = pool[head].next;
+            pool.release(head);
+            head = next;
+            pool[head].prev = none;
+            begin = 0;
+        }
+    }
+
+    void popBack(LotPool& pool) {
+        --end;
+        if (head == tail && begin == end) { reset(pool); return; }
+        if (end == 0) {
+            uint32_t prev = pool[tail].prev;
+            pool.release(tail);
+            tail = prev;
+            pool[tail].next = none;
+            end = LotPool::lotsPerChunk;
+        }
+    }
+
+    void reset(LotPool& pool) {
+        pool.release(head);
+        head = tail = none;
+        begin = end = 0;
+    }
+
+    void trim(LotPool& pool) { // Drop lots emptied out of order once they reach either end
+        while (!empty() && front(pool).quantity == 0) popFront(pool);
+        while (!empty() && back(pool).quantity == 0) popBack(pool);
+    }
+
+public:
+    bool empty() const { return head == none; }
+
+    void push(LotPool& pool, const TaxLot& lot) {
+        if (empty()) {
+            head = tail = pool.allocate();
+            begin = end = 0;
+        } else if (end == LotPool::lotsPerChunk) {
+            uint32_t c = pool.allocate();
+            pool[c].prev = tail;
+            pool[tail].next = c;
+            tail = c;
+            end = 0;
+        }
+        pool[tail].lots[end++] = lot;
+    }
+
+    Money relieve(LotPool& pool, int qty, LotRelief order) { // Take qty shares from one end, returns their cost
+        Money cost;
+        while (qty > 0 && !empty()) {
+            TaxLot& lot = order == LotRelief::Fifo ? front(pool) : back(pool);
+            int take = min(qty, lot.quantity);
+            lot.quantity -= take;
+            qty -= take;
+            cost += Price::fromTicks(lot.cost) * take;
+            if (lot.quantity == 0) trim(pool);
+        }
+        return cost;
+    }
+
+    TaxLot* find(LotPool& pool, uint32_t id) { // Ids grow along the queue, so skip whole chunks then binary search
+        for (uint32_t c = head; c != none; c = pool[c].next) {
+            TaxLot* first = pool[c].lots + (c == head ? begin : 0);
+            TaxLot* last = pool[c].lots + (c == tail ? end : LotPool::lotsPerChunk);
+            if (last[-1].id < id) continue;
+            TaxLot* lot = lower_bound(first, last, id, [](const TaxLot& l, uint32_t v) { return l.id < v; });
+            return lot != last && lot->id == id && lot->quantity > 0 ? lot : nullptr;
+        }
+        return nullptr;
+    }
+
+    Money relieveLot(LotPool& pool, TaxLot& lot, int qty) { // Specific-lot relief, qty must not exceed the lot
+        lot.quantity -= qty;
+        Money cost = Price::fromTicks(lot.cost) * qty;
+        if (lot.quantity == 0) trim(pool);
+        return cost;
+    }
+
+    double split(LotPool& pool, double ratio, Money& basis) { // Scale every lot, returns the fractional shares dropped and sets the new total cost
+        double dropped = 0;
+        for (uint32_t c = head; c != none; c = pool[c].next) {
+            uint32_t first = c == head ? begin : 0, last = c == tail ? end : LotPool::lotsPerChunk;
+            for (uint32_t i = first; i < last; ++i) {
+                TaxLot& lot = pool[c].lots[i];
+                double exact = lot.quantity * ratio;
+                lot.quantity = (int32_t)floor(exact + 1e-9);
+                lot.cost = llround(lot.cost / ratio);
+                dropped += exact - lot.quantity;
+                basis += Price::fromTicks(lot.cost) * lot.quantity;
+            }
+        }
+        trim(pool); // A reverse split can empty small lots
+        return max(dropped, 0.0);
+    }
+
+    template <typename F>
+    void forEach(const LotPool& pool, F fn) const { // Open lots, oldest first
+        for (uint32_t c = head; c != none; c = pool[c].next) {
+            uint32_t first = c == head ? begin : 0, last = c == tail ? end : LotPool::lotsPerChunk;
+            for (uint32_t i = first; i < last; ++i)
+                if (pool[c].lots[i].quantity > 0) fn(pool[c].lots[i]);
+        }
+    }
+
+    void clear(LotPool& pool) { // Return every chunk to the pool
+        while (head != none) {
+            uint32_t next = pool[head].next;
+            pool.release(head);
+            head = next;
+        }
+        tail = none;
+        begin = end = 0;
+    }
+};
+
+class UserOwnedStock : public SimulatedStock { // Derived class for stocks owned by the user
+private:
+    int quantity;
+    Money costBasis; // What the shares still held cost, so the average cost is costBasis / quantity
+    Money realized; // Profit or loss locked in by sales of this position
+    LotPool* pool; // Where the tax lots live, null for average-cost accounting
+    LotQueue lots;
+
+public:
+    UserOwnedStock(const SimulatedStock* base, int qty) // Constructor to initialize user-owned stock attributes
+        : UserOwnedStock(base, qty, base->getPrice()) {}
+
+    UserOwnedStock(const SimulatedStock* base, int qty, double price, LotPool* pool = nullptr) // Constructor with an explicit fill price, which becomes the cost
+        : SimulatedStock(base->getId(), base->getName(), price, base->getRiskLevel()), quantity(0), pool(pool) {
+        buy(qty, price);
+    }
+
+    ~UserOwnedStock() {
+        if (pool) lots.clear(*pool);
+    }
+
+    UserOwnedStock(const UserOwnedStock&) = delete; // The lot chunks belong to this position
+    UserOwnedStock& operator=(const UserOwnedStock&) = delete;
+
+    int getQuantity() const { return quantity; } // Getter for quantity of stocks owned
+
+    double getTotalValue() const { return quantity * currentPrice; } // Calculate total value of owned stocks
+
+    Money getCostBasis() const { return costBasis; }
+    double getAverageCost() const { return quantity ? costBasis.toDouble() / quantity : 0.0; }
+    Money getRealizedPnl() const { return realized; }
+    Money getUnrealizedPnl(double price) const { return Price::fromDouble(price) * quantity - costBasis; } // At a market price
+
+    void buy(int qty) { buy(qty, currentPrice); } // Buy more stocks, increasing the quantity owned
+    void buy(int qty, double price) { // Buy more at a fill price, as a new tax lot when lots are kept
+        Price fill = Price::fromDouble(price);
+        quantity += qty;
+        costBasis += fill * qty;
+        if (pool) lots.push(*pool, TaxLot{pool->nextId(), qty, fill.getTicks()});
+    }
+
+    void sell(int qty) { // Sell stocks, decreasing the quantity owned
+        if (qty <= quantity) sell(qty, currentPrice);
+        else cout << "Not enough stock to sell.\n";
+    }
+    Money sell(int qty, double price, LotRelief order = LotRelief::Fifo) { // Sell at a fill price, returns the realized P&L of this sale
+        Money relieved; // Lot costs, or the average cost without lots
+        if (pool) relieved = lots.relieve(*pool, qty, order);
+        else relieved = qty == quantity ? costBasis : costBasis.scaled(qty, quantity); // Closing out leaves no rounding residue
+        return settle(qty, price, relieved);
+    }
+
+    bool sellLot(uint32_t lotId, int qty, double price, Money& gain) { // Relieve one specific lot, false if it is gone or too small
+        TaxLot* lot = pool ? lots.find(*pool, lotId) : nullptr;
+        if (!lot || lot->quantity < qty) return false;
+        gain = settle(qty, price, lots.relieveLot(*pool, *lot, qty));
+        return true;
+    }
+
+    template <typename F>
+    void forEachLot(F fn) const { if (pool) lots.forEach(*pool, fn); } // Open tax lots, oldest first
+
+    Money split(double ratio, double price, Money& gain) { // Scale the holding, returns cash in lieu of fractional shares at the post-split price
+        applySplit(ratio);
+        double exact = quantity * ratio, fraction;
+        Money basis; // Cost of the whole shares left, the same total cost spread over more or fewer shares
+        if (pool) {
+            fraction = lots.split(*pool, ratio, basis);
+        } else {
+            fraction = exact - floor(exact + 1e-9);
+            basis = fraction > 0 ? costBasis - Money::fromDouble(costBasis.toDouble() * fraction / exact) : costBasis;
+        }
+        quantity = (int)llround(exact - fraction);
+        Money cash = Money::fromDouble(fraction * price);
+        gain = cash - (costBasis - basis); // The fraction is sold, lot rounding is settled with it
+        realized += gain;
+        costBasis = basis;
+        return cash;
+    }
+
+private:
+    Money settle(int qty, double price, Money relieved) {
+        Money gain = Price::fromDouble(price) * qty - relieved;
+        costBasis -= relieved;
+        quantity -= qty;
+        realized += gain;
+        return gain;
+    }
+
+public:
+
+    void display() const override { // Override to display user-owned stock information
+        SimulatedStock::display();
+        cout << " | Quantity: " << quantity << " | Value: $" << fixed << setprecision(2) << getTotalValue() // Display quantity and total value
+             << " | Avg cost: $" << getAverageCost() << " | Unrealized: $" << getUnrealizedPnl(currentPrice) << "\n";
+    }
+};
+
+struct PnlReport { // Profit and loss of one account at a set of market prices
+    Money marketValue; // Holdings at the given prices
+    Money costBasis; // What the holdings cost
+    Money unrealized; // marketValue - costBasis
+    Money realized; // Locked in by past sales, including closed positions
+};
+
+enum class TradeStatus { Ok, InsufficientBalance, InsufficientQuantity, NotFound }; // Outcome of a portfolio trade
+
+class UserPortfolio { // Class representing the user's portfolio
+private:
+    Money balance;
+    Money realized; // Realized P&L of every sale, kept when a position is closed out
+    LotPool lots; // Tax lots of every position
+    LotRelief relief = LotRelief::Fifo; // Lot order for sales that don't name a lot
+    vector<UserOwnedStock*> ownedStocks;    // Vector to store stocks owned by the user
+
+    void close(size_t i) { // Remove a position that has been sold out
+        delete ownedStocks[i];
+        ownedStocks.erase(ownedStocks.begin() + i);
+    }
+
+public:
+    UserPortfolio(double initialBalance = 3000.0) : balance(Money::fromDouble(initialBalance)) {} // Constructor to initialize portfolio with an initial balance
+
+    UserPortfolio(const UserPortfolio&) = delete; // Positions point into this portfolio's lot pool
+    UserPortfolio& operator=(const UserPortfolio&) = delete;
+
+    ~UserPortfolio() { // Destructor to clean up dynamically allocated memory
+        for (auto stock : ownedStocks)
+            delete stock;
+    }
+
+    void display() const {
+        STOCKSIM_TIMED(Render);
+        STOCKSIM_TRACE("render");
+        cout << "\n~ This is Your Portfolio ~\n";
+        cout << "Balance: $" << fixed << setprecision(2) << balance.toDouble() << "\n"; // Display current balance
+        cout << "Realized P&L: $" << realized << "\n";
+        if (ownedStocks.empty()) { // Check if there are no stocks owned
+            cout << "No stocks owned yet\n";
+        } else {
+            for (const auto& stock : ownedStocks) // Loop through owned stocks and display each one
+                stock->display();
+        }
+    }
+
+    void buyStock(SimulatedStock* s, int qty) { // Function to buy stocks
+        if (applyBuy(s, qty, s->getPrice()) == TradeStatus::InsufficientBalance) // Buy at the current market price
+            cout << "Insufficient balance.\n"; 
+    }
+
+    void sellStock(string stockName, int qty) { // Function to sell stocks
+        for (const auto& stock : ownedStocks) { // Loop through owned stocks to find the stock to sell
+            if (stock->getName() == stockName) {
+                if (applySell(stock->getId(), qty, stock->getPrice()) == TradeStatus::InsufficientQuantity)
+                    cout << "Not enough quantity.\n";
+                return;
+            }
+        }
+        cout << "Stock not found in portfolio.\n";
+    }
+
+    TradeStatus applyBuy(const SimulatedStock* s, int qty, double price) { // Buy at an explicit fill price, without console output
+        STOCKSIM_TIMED(BuyStock);
+        STOCKSIM_TRACE("order");
+        Money total = Price::fromDouble(price) * qty;  // Calculate total cost of stocks to be bought, exact in ticks
+        if (total > balance) return TradeStatus::InsufficientBalance; // Check if the user has enough balance
+        balance -= total;
+
+        for (auto& stock : ownedStocks) { // Check if the stock is already owned
+            if (stock->getId() == s->getId()) {
+                stock->buy(qty, price); // If already owned, increase the quantity and the cost basis
+                return TradeStatus::Ok;
+            }
+        }
+        ownedStocks.push_back(new UserOwnedStock(s, qty, price, &lots)); // If not owned, create a new UserOwnedStock and add it to the portfolio
+        return TradeStatus::Ok;
+    }
+
+    TradeStatus applySell(int stockId, int qty, double price) { // Sell at an explicit fill price, without console output
+        STOCKSIM_TIMED(SellStock);
+        STOCKSIM_TRACE("order");
+        for (size_t i = 0; i < ownedStocks.size(); ++i) { // Loop through owned stocks to find the stock to sell
+            if (ownedStocks[i]->getId() == stockId) {
+                if (ownedStocks[i]->getQuantity() < qty) return TradeStatus::InsufficientQuantity; // Check if the user has enough quantity to sell
+                realized += ownedStocks[i]->sell(qty, price, relief); // Decrease the quantity of stocks owned
+                balance += Price::fromDouble(price) * qty; // Add income from selling stocks
+                if (ownedStocks[i]->getQuantity() == 0) close(i); // If quantity becomes zero, remove the stock from the portfolio
+                return TradeStatus::Ok;
+            }
+        }
+        return TradeStatus::NotFound;
+    }
+
+    TradeStatus applySellLot(int stockId, uint32_t lotId, int qty, double price) { // Sell out of one specific tax lot
+        STOCKSIM_TIMED(SellStock);
+        STOCKSIM_TRACE("order");
+        for (size_t i = 0; i < ownedStocks.size(); ++i) {
+            if (ownedStocks[i]->getId() != stockId) continue;
+            Money gain;
+            if (!ownedStocks[i]->sellLot(lotId, qty, price, gain)) return TradeStatus::InsufficientQuantity;
+            realized += gain;
+            balance += Price::fromDouble(price) * qty;
+            if (ownedStocks[i]->getQuantity() == 0) close(i);
+            return TradeStatus::Ok;
+        }
+        return TradeStatus::NotFound;
+    }
+
+    void applySplit(int stockId, double ratio, double price) { // Corporate split, fractions paid out in cash at the post-split price
+        for (size_t i = 0; i < ownedStocks.size(); ++i) {
+            if (ownedStocks[i]->getId() != stockId) continue;
+            Money gain;
+            balance += ownedStocks[i]->split(ratio, price, gain);
+            realized += gain;
+            if (ownedStocks[i]->getQuantity() == 0) close(i);
+            return;
+        }
+    }
+
+    void applyDividend(int stockId, double amount) { // Cash dividend per share, the position's own quote goes ex-dividend too
+        for (const auto& stock : ownedStocks) {
+            if (stock->getId() != stockId) continue;
+            deposit(stock->getQuantity() * amount);
+            stock->applyDividend(amount);
+            return;
+        }
+    }
+
+    void setLotRelief(LotRelief order) { relief = order; }
+    LotRelief getLotRelief() const { return relief; }
+    const LotPool& getLotPool() const { return lots; }
+
+    void markToMarket(const double* prices, size_t count) { // Quote every position at snapshot prices indexed by stock ID - 1, so values, P&L and sales use the market's price
+        STOCKSIM_TIMED(UpdatePrices);
+        for (auto& stock : ownedStocks) {
+            size_t slot = stock->getId() - 1;
+            if (slot < count) stock->recordPrice(prices[slot]);
+        }
+    }
+
+    double getBalance() const { return balance.toDouble(); } // Getter for current balance
+    Money getCash() const { return balance; } // Exact balance
+
+    void deposit(double amount) { balance += Money::fromDouble(amount); } // Add cash, e.g. a dividend
+
+    const vector<UserOwnedStock*>& getOwnedStocks() const { return ownedStocks; } // Getter for owned positions
+
+    vector<double> getExposures(const vector<double>& prices) const { // Value held in each stock, indexed by stock ID - 1
+        vector<double> exposures(prices.size());
+        for (const auto& stock : ownedStocks) {
+            size_t slot = stock->getId() - 1;
+            if (slot < prices.size()) exposures[slot] = stock->getQuantity() * prices[slot];
+        }
+        return exposures;
+    }
+
+    double getMarketValue(const vector<double>& prices) const { return getMarketValue(prices.data(), prices.size()); }
+
+    double getMarketValue(const double* prices, size_t count) const { // Value holdings at snapshot prices indexed by stock ID - 1
+        double total = 0;
+        for (const auto& stock : ownedStocks) {
+            size_t slot = stock->getId() - 1;
+            if (slot < count) total += stock->getQuantity() * prices[slot];
+        }
+        return total;
+    }
+
+    Money getRealizedPnl() const { return realized; }
+
+    PnlReport getPnl(const double* prices, size_t count) const { // From the running cost basis, no trade history needed
+        PnlReport report;
+        report.realized = realized;
+        for (const auto& stock : ownedStocks) {
+            size_t slot = stock->getId() - 1;
+            if (slot >= count) continue;
+            report.marketValue += Price::fromDouble(prices[slot]) * stock->getQuantity();
+            report.costBasis += stock->getCostBasis();
+        }
+        report.unrealized = report.marketValue - report.costBasis;
+        return report;
+    }
+};
+
+class PriceBoard { // Seqlock-protected double-buffered price array, readers never lock and the writer never waits
+private:
+    vector<atomic<double>> buffers[2]; // Front buffer is read while the back buffer is written
+    atomic<uint64_t> ticks[2]; // Tick number stored with each buffer
+    atomic<uint64_t> sequence{0}; // Version * 2, odd while the back buffer is being written
+
+public:
+    explicit PriceBoard(size_t count) : buffers{vector<atomic<double>>(count), vector<atomic<double>>(count)} {
+        ticks[0] = ticks[1] = 0;
+    }
+
+    size_t size() const { return buffers[0].size(); }
+
+    void publish(const vector<SimulatedStock*>& market, uint64_t tick) { // Single writer, prices indexed by stock ID - 1
+        uint64_t seq = sequence.load(memory_order_relaxed);
+        uint64_t version = seq / 2;
+        auto& back = buffers[(version + 1) & 1];
+        sequence.store(seq + 1, memory_order_relaxed); // Invalidate readers still on the back buffer
+        atomic_thread_fence(memory_order_release);
+        for (size_t i = 0; i < back.size() && i < market.size(); ++i)
+            back[i].store(market[i]->getPrice(), memory_order_relaxed);
+        ticks[(version + 1) & 1].store(tick, memory_order_relaxed);
+        sequence.store(seq + 2, memory_order_release); // Flip the back buffer to the front
+    }
+
+    uint64_t snapshot(vector<double>& out) const { // Copy a consistent view of all prices, returns its tick
+        out.resize(size());
+        while (true) {
+            uint64_t before = sequence.load(memory_order_acquire);
+            uint64_t version = before / 2;
+            const auto& front = buffers[version & 1];
+            for (size_t i = 0; i < out.size(); ++i)
+                out[i] = front[i].load(memory_order_relaxed);
+            uint64_t tick = ticks[version & 1].load(memory_order_relaxed);
+            atomic_thread_fence(memory_order_acquire);
+            // The front buffer is only rewritten once the writer starts the version after next
+            if (sequence.load(memory_order_relaxed) <= version * 2 + 2) return tick;
+        }
+    }
+};
+
+class IndicatorBook { // Technical indicators for every instrument, updated in O(1) per tick and stored as SoA arrays
+private:
+    size_t count; // Number of instruments
+    size_t window; // Rolling window length in ticks
+    double alpha; // EMA smoothing factor 2 / (window + 1)
+    uint64_t samples = 0; // Prices seen per instrument, shared since the whole market ticks together
+    vector<double> last, ema, sum, sumSq, retSum, retSumSq, avgGain, avgLoss; // One entry per instrument
+    vector<double> prices, returns; // Rolling windows, instrument i owns [i * window, (i + 1) * window)
+    vector<uint64_t> minQueue, maxQueue; // Monotonic queues of sample numbers, same layout as the windows
+    vector<uint64_t> minHead, minTail, maxHead, maxTail; // Queue bounds per instrument
+
+    double windowPrice(size_t i, uint64_t sample) const { return prices[i * window + sample % window]; }
+
+    template <typename Better>
+    void pushExtreme(size_t i, vector<uint64_t>& queue, uint64_t& head, uint64_t& tail, Better better) { // Sliding window min/max
+        double p = windowPrice(i, samples);
+        uint64_t* q = &queue[i * window];
+        if (tail > head && samples >= window && q[head % window] <= samples - window) ++head; // Drop the expired entry
+        while (tail > head && !better(windowPrice(i, q[(tail - 1) % window]), p)) --tail; // Drop dominated entries
+        q[tail++ % window] = samples;
+    }
+
+public:
+    IndicatorBook(const vector<double>& initialPrices, size_t window = 14)
+        : count(initialPrices.size()), window(window < 2 ? 2 : window), alpha(2.0 / (this->window + 1)),
+          last(count), ema(count), sum(count), sumSq(count), retSum(count), retSumSq(count), avgGain(count), avgLoss(count),
+          prices(count * this->window), returns(count * this->window), minQueue(count * this->window), maxQueue(count * this->window),
+          minHead(count), minTail(count), maxHead(count), maxTail(count) {
+        update(initialPrices);
+    }
+
+    void update(const vector<double>& current) { // Append one tick of prices, indexed like the market
+        size_t pos = samples % window;
+        bool full = samples >= window; // Oldest value leaves the window
+        bool first = samples == 0;
+        double w = (double)window;
+
+        for (size_t i = 0; i < count; ++i) { // Rolling sums of prices and returns
+            double p = current[i];
+            double r = first ? 0.0 : p / last[i] - 1;
+            double& slotP = prices[i * window + pos];
+            double& slotR = returns[i * window + pos];
+            double oldP = full ? slotP : 0.0, oldR = full ? slotR : 0.0;
+            sum[i] += p - oldP;
+            sumSq[i] += p * p - oldP * oldP;
+            retSum[i] += r - oldR;
+            retSumSq[i] += r * r - oldR * oldR;
+            slotP = p;
+            slotR = r;
+        }
+        for (size_t i = 0; i < count; ++i) { // EMA and Wilder-smoothed gains/losses for RSI
+            double p = current[i];
+            double change = first ? 0.0 : p - last[i];
+            ema[i] = first ? p : ema[i] + alpha * (p - ema[i]);
+            avgGain[i] += ((change > 0 ? change : 0.0) - avgGain[i]) / w;
+            avgLoss[i] += ((change < 0 ? -change : 0.0) - avgLoss[i]) / w;
+            last[i] = p;
+        }
+        for (size_t i = 0; i < count; ++i) { // Window min/max, amortized O(1)
+            pushExtreme(i, minQueue, minHead[i], minTail[i], [](double a, double b) { return a < b; });
+            pushExtreme(i, maxQueue, maxHead[i], maxTail[i], [](double a, double b) { return a > b; });
+        }
+        ++samples;
+    }
+
+    size_t size() const { return count; }
+    size_t getWindow() const { return window; }
+    size_t filled() const { return samples < window ? samples : window; } // Samples currently in the window
+
+    double sma(size_t i) const { return sum[i] / filled(); } // Simple moving average
+    double getEma(size_t i) const { return ema[i]; } // Exponential moving average
+
+    double variance(size_t i) const { // Rolling variance of prices
+        double n = filled(), mean = sum[i] / n;
+        double v = sumSq[i] / n - mean * mean;
+        return v > 0 ? v : 0.0;
+    }
+
+    double volatility(size_t i) const { // Rolling standard deviation of daily returns
+        size_t n = samples <= window ? samples - 1 : window; // The first sample has no return
+        if (n < 2) return 0.0;
+        double mean = retSum[i] / n;
+        double v = (retSumSq[i] - n * mean * mean) / (n - 1);
+        return v > 0 ? sqrt(v) : 0.0;
+    }
+
+    double rsi(size_t i) const { // Relative strength index in [0, 100]
+        if (avgLoss[i] == 0) return avgGain[i] == 0 ? 50.0 : 100.0;
+        return 100.0 - 100.0 / (1.0 + avgGain[i] / avgLoss[i]);
+    }
+
+    double bollingerUpper(size_t i, double k = 2.0) const { return sma(i) + k * sqrt(variance(i)); }
+    double bollingerLower(size_t i, double k = 2.0) const { return sma(i) - k * sqrt(variance(i)); }
+
+    double windowMin(size_t i) const { return windowPrice(i, minQueue[i * window + minHead[i] % window]); }
+    double windowMax(size_t i) const { return windowPrice(i, maxQueue[i * window + maxHead[i] % window]); }
+
+    void adjust(size_t i, double factor) { // Rescale an instrument's price state after a corporate action, returns are unchanged
+        for (size_t k = 0; k < window; ++k) prices[i * window + k] *= factor; // Order is kept, so the min/max queues stay valid
+        last[i] *= factor;
+        ema[i] *= factor;
+        sum[i] *= factor;
+        sumSq[i] *= factor * factor;
+        avgGain[i] *= factor; // Price changes scale with the price
+        avgLoss[i] *= factor;
+    }
+};
+
+class CovarianceMatrix { // Streaming covariance of log returns across the market, one rank-1 update per tick
+private:
+    static constexpr size_t block = 64; // Tile width, keeps a slice of the update vector in L1 cache
+    size_t count; // Number of instruments
+    double decay; // Exponential decay per tick, 1 weights every tick equally
+    uint64_t samples = 0; // Returns seen so far
+    vector<double> last, mean, dx, dy; // Previous prices, running mean and update vectors
+    vector<double> moments; // Upper triangle of the co-moment matrix, row-major count x count
+
+public:
+    CovarianceMatrix(const vector<double>& initialPrices, double decay = 1.0)
+        : count(initialPrices.size()), decay(decay), last(initialPrices), mean(count), dx(count), dy(count), moments(count * count) {}
+
+    void update(const vector<double>& prices) { // Add one tick of log returns
+        double a = 1.0, b = 1.0; // moments = a * moments + b * dx * dy^T
+        ++samples;
+        if (decay < 1.0) { // Exponentially weighted mean and covariance
+            a = decay;
+            b = decay * (1.0 - decay);
+            for (size_t i = 0; i < count; ++i) {
+                double r = log(prices[i] / last[i]);
+                dx[i] = dy[i] = r - mean[i];
+                mean[i] += (1.0 - decay) * dx[i];
+            }
+        } else { // Welford update of the equally weighted co-moments
+            double inv = 1.0 / samples;
+            for (size_t i = 0; i < count; ++i) {
+                double r = log(prices[i] / last[i]);
+                dx[i] = r - mean[i];
+                mean[i] += dx[i] * inv;
+                dy[i] = r - mean[i];
+            }
+        }
+        last = prices;
+
+        for (size_t jb = 0; jb < count; jb += block) { // Column tiles of the upper triangle
+            size_t jEnd = jb + block < count ? jb + block : count;
+            const double* y = dy.data();
+            for (size_t i = 0; i < jEnd; ++i) {
+                double* row = moments.data() + i * count;
+                double xi = b * dx[i];
+                for (size_t j = i > jb ? i : jb; j < jEnd; ++j) // Contiguous, vectorized by the compiler
+                    row[j] = a * row[j] + xi * y[j];
+            }
+        }
+    }
+
+    size_t size() const { return count; }
+    uint64_t getSamples() const { return samples; }
+
+    void adjust(size_t i, double factor) { last[i] *= factor; } // A corporate action is not a return
+
+    double covariance(size_t i, size_t j) const { // Covariance of daily log returns
+        if (i > j) swap(i, j);
+        if (decay < 1.0) return moments[i * count + j];
+        return samples > 1 ? moments[i * count + j] / (samples - 1) : 0.0;
+    }
+
+    double correlation(size_t i, size_t j) const {
+        double denom = sqrt(covariance(i, i) * covariance(j, j));
+        return denom > 0 ? covariance(i, j) / denom : 0.0;
+    }
+
+    double portfolioVariance(const vector<double>& exposures) const { // w' C w for exposures indexed like the market
+        double total = 0;
+        for (size_t i = 0; i < count; ++i) {
+            if (exposures[i] == 0) continue;
+            double cross = 0;
+            for (size_t j = i + 1; j < count; ++j) cross += covariance(i, j) * exposures[j];
+            total += exposures[i] * (covariance(i, i) * exposures[i] + 2 * cross);
+        }
+        return total;
+    }
+};
+
+enum class IndexWeighting { Price, Cap, Equal };
+
+struct IndexDefinition {
+    string name;
+    IndexWeighting weighting = IndexWeighting::Price;
+    vector<uint32_t> constituents; // Stock ID - 1 of each member
+    vector<double> shares; // Shares outstanding per constituent, cap-weighted only
+    size_t rebalanceEvery = 0; // Ticks between equal-weight rebalances, 0 never rebalances
+    double baseValue = 1000.0; // Level on the day the index is created
+};
+
+class IndexCalculator { // Many indices over one market, each level is sum(units * price) / divisor and moves only with changed prices
+private:
+    struct Index {
+        IndexDefinition definition;
+        vector<double> units; // Per constituent, shares for cap weights, 1 for price weights, value / price for equal weights
+        vector<uint32_t> entries; // Position of each constituent in the CSR arrays
+    };
+
+    size_t instruments;
+    size_t recomputeEvery; // Ticks between exact recomputes that wash out accumulated rounding
+    uint64_t ticks = 0;
+    vector<Index> indices;
+    vector<double> sums, divisors; // Per index
+    vector<double> last; // Prices the sums were built from
+    vector<uint32_t> offsets; // CSR by instrument: entries of instrument i are [offsets[i], offsets[i + 1])
+    vector<uint32_t> entryIndex; // Index of each entry
+    vector<uint32_t> entryMember; // Position of each entry in its index's constituent list
+    vector<double> entryUnits; // Units of each entry
+    bool dirty = false; // CSR needs rebuilding after add()
+
+    void rebuild() { // Counting sort of every (instrument, index) pair by instrument
+        offsets.assign(instruments + 1, 0);
+        for (const auto& index : indices)
+            for (uint32_t slot : index.definition.constituents) ++offsets[slot + 1];
+        for (size_t i = 0; i < instruments; ++i) offsets[i + 1] += offsets[i];
+        entryIndex.resize(offsets[instruments]);
+        entryMember.resize(offsets[instruments]);
+        entryUnits.resize(offsets[instruments]);
+        vector<uint32_t> fill(offsets.begin(), offsets.end() - 1);
+        for (size_t x = 0; x < indices.size(); ++x) {
+            Index& index = indices[x];
+            for (size_t k = 0; k < index.units.size(); ++k) {
+                uint32_t e = fill[index.definition.constituents[k]]++;
+                entryIndex[e] = (uint32_t)x;
+                entryMember[e] = (uint32_t)k;
+                entryUnits[e] = index.units[k];
+                index.entries[k] = e;
+            }
+        }
+        dirty = false;
+    }
+
+    double exactSum(const Index& index) const {
+        double sum = 0;
+        for (size_t k = 0; k < index.units.size(); ++k) sum += index.units[k] * last[index.definition.constituents[k]];
+        return sum;
+    }
+
+    void setUnits(size_t x) { // Units for the index's weighting at the current prices
+        Index& index = indices[x];
+        const IndexDefinition& d = index.definition;
+        size_t n = d.constituents.size();
+        for (size_t k = 0; k < n; ++k) {
+            double p = last[d.constituents[k]];
+            switch (d.weighting) {
+                case IndexWeighting::Price: index.units[k] = 1.0; break;
+                case IndexWeighting::Cap: index.units[k] = k < d.shares.size() ? d.shares[k] : 0.0; break;
+                case IndexWeighting::Equal: index.units[k] = p > 0 ? 1.0 / (n * p) : 0.0; break; // Equal value in every member
+            }
+        }
+    }
+
+public:
+    IndexCalculator(const vector<double>& prices, size_t recomputeEvery = 1000)
+        : instruments(prices.size()), recomputeEvery(recomputeEvery), last(prices), offsets(prices.size() + 1) {}
+
+    size_t add(IndexDefinition definition) { // Starts at its base value at the current prices
+        for (uint32_t slot : definition.constituents)
+            if (slot >= instruments) throw runtime_error("index constituent out of range");
+        size_t x = indices.size();
+        size_t n = definition.constituents.size();
+        indices.push_back(Index{move(definition), vector<double>(n), vector<uint32_t>(n)});
+        setUnits(x);
+        double sum = exactSum(indices[x]);
+        sums.push_back(sum);
+        divisors.push_back(sum > 0 ? sum / indices[x].definition.baseValue : 1.0);
+        dirty = true;
+        return x;
+    }
+
+    void rebalance(size_t x) { // New units, and a divisor change that keeps the level where it was
+        double level = this->level(x);
+        setUnits(x);
+        Index& index = indices[x];
+        if (!dirty)
+            for (size_t k = 0; k < index.units.size(); ++k) entryUnits[index.entries[k]] = index.units[k];
+        sums[x] = exactSum(index);
+        if (level > 0) divisors[x] = sums[x] / level;
+    }
+
+    void update(const uint32_t* changed, size_t count, const double* prices) { // Only the listed instruments moved
+        if (dirty) rebuild();
+        for (size_t c = 0; c < count; ++c) {
+            uint32_t slot = changed[c];
+            double delta = prices[slot] - last[slot];
+            last[slot] = prices[slot];
+            for (uint32_t e = offsets[slot]; e < offsets[slot + 1]; ++e) sums[entryIndex[e]] += entryUnits[e] * delta;
+        }
+        ++ticks;
+        for (size_t x = 0; x < indices.size(); ++x) {
+            size_t every = indices[x].definition.rebalanceEvery;
+            if (every && ticks % every == 0) rebalance(x);
+        }
+        if (recomputeEvery && ticks % recomputeEvery == 0) recompute();
+    }
+
+    void update(const vector<double>& prices) { // Finds the changed instruments itself
+        vector<uint32_t> changed;
+        for (size_t i = 0; i < instruments && i < prices.size(); ++i)
+            if (prices[i] != last[i]) changed.push_back((uint32_t)i);
+        update(changed.data(), changed.size(), prices.data());
+    }
+
+    void applySplit(uint32_t slot, double ratio) { // Cap and equal weights hold ratio times the units, price weights change the divisor
+        if (dirty) rebuild();
+        double price = last[slot] / ratio;
+        for (uint32_t e = offsets[slot]; e < offsets[slot + 1]; ++e) {
+            uint32_t x = entryIndex[e];
+            Index& index = indices[x];
+            if (index.definition.weighting == IndexWeighting::Price) {
+                double before = sums[x];
+                sums[x] += entryUnits[e] * (price - last[slot]);
+                if (before > 0) divisors[x] *= sums[x] / before; // Level unchanged
+            } else {
+                entryUnits[e] *= ratio;
+                index.units[entryMember[e]] = entryUnits[e];
+            }
+        }
+        last[slot] = price;
+    }
+
+    void recompute() { // Exact sums from scratch
+        for (size_t x = 0; x < indices.size(); ++x) sums[x] = exactSum(indices[x]);
+    }
+
+    size_t size() const { return indices.size(); }
+    const string& name(size_t x) const { return indices[x].definition.name; }
+    double level(size_t x) const { return sums[x] / divisors[x]; }
+    double getDivisor(size_t x) const { return divisors[x]; }
+};
+
+class FactorModel { // Correlated returns from a market factor, sector factors and idiosyncratic noise
+private:
+    static constexpr size_t block = 256; // Rows per tile of the loading matrix
+    size_t count; // Number of instruments
+    size_t factors; // Number of common factors
+    vector<double> loadings; // Exposure of each instrument to each factor, row-major count x factors
+    vector<double> idioVol; // Standard deviation of each instrument's own noise
+    vector<double> factorDraws, shocks; // Scratch vectors reused every tick
+    mt19937_64 rng; // Random source for factor and noise draws
+    normal_distribution<double> normal{0.0, 1.0};
+
+public:
+    FactorModel(size_t count, size_t factors, unsigned seed = random_device{}())
+        : count(count), factors(factors), loadings(count * factors), idioVol(count), factorDraws(factors), shocks(count), rng(seed) {}
+
+    static FactorModel sectorModel(const vector<SimulatedStock*>& market, const vector<size_t>& sectorOf, size_t sectorCount,
+                                   double marketShare = 0.4, double sectorShare = 0.3, unsigned seed = random_device{}()) {
+        // Factor 0 is the market, factor 1 + s is sector s, variance shares are split so each stock keeps its own volatility
+        FactorModel model(market.size(), 1 + sectorCount, seed);
+        double idioShare = 1.0 - marketShare - sectorShare;
+        for (size_t i = 0; i < market.size(); ++i) {
+            double sigma = market[i]->volatility() / sqrt(3.0); // Same variance as the uniform daily move of updatePrice()
+            model.setLoading(i, 0, sigma * sqrt(marketShare));
+            model.setLoading(i, 1 + sectorOf[i], sigma * sqrt(sectorShare));
+            model.setIdiosyncraticVol(i, sigma * sqrt(idioShare > 0 ? idioShare : 0.0));
+        }
+        return model;
+    }
+
+    static FactorModel riskSectorModel(const vector<SimulatedStock*>& market, unsigned seed = random_device{}()) { // Risk levels as sectors
+        vector<size_t> sectorOf(market.size());
+        for (size_t i = 0; i < market.size(); ++i) sectorOf[i] = VolatilityProfile::riskIndex(market[i]->getRiskLevel());
+        return sectorModel(market, sectorOf, 3, 0.4, 0.3, seed);
+    }
+
+    void setLoading(size_t instrument, size_t factor, double value) { loadings[instrument * factors + factor] = value; }
+    void setIdiosyncraticVol(size_t instrument, double value) { idioVol[instrument] = value; }
+    size_t size() const { return count; }
+    size_t factorCount() const { return factors; }
+
+    const vector<double>& generate() { // Draw one tick of correlated relative returns
+        for (auto& f : factorDraws) f = normal(rng);
+        for (size_t i = 0; i < count; ++i) shocks[i] = idioVol[i] * normal(rng);
+        const double* f = factorDraws.data();
+        for (size_t rb = 0; rb < count; rb += block) { // Loadings times factor draws, one tile of rows at a time
+            size_t rEnd = rb + block < count ? rb + block : count;
+            for (size_t i = rb; i < rEnd; ++i) {
+                const double* row = loadings.data() + i * factors;
+                double sum = 0;
+                for (size_t k = 0; k < factors; ++k) sum += row[k] * f[k];
+                shocks[i] += sum;
+            }
+        }
+        return shocks;
+    }
+
+    void tick(const vector<SimulatedStock*>& market) { // Move every stock by one correlated draw
+        const vector<double>& r = generate();
+        for (size_t i = 0; i < market.size() && i < count; ++i)
+            market[i]->applyReturn(r[i]);
+    }
+};
+
+template <typename Fn>
+void parallelFor(size_t count, Fn fn) { // Run fn(begin, end) over contiguous chunks of [0, count) on all cores
+    size_t workers = thread::hardware_concurrency();
+    if (workers == 0) workers = 1;
+    if (workers > count) workers = count ? count : 1;
+    size_t chunk = (count + workers - 1) / workers;
+    vector<thread> pool;
+    for (size_t w = 1; w < workers; ++w) {
+        size_t begin = w * chunk, end = begin + chunk < count ? begin + chunk : count;
+        if (begin < end) pool.emplace_back([=, &fn] { fn(begin, end); });
+    }
+    fn(0, chunk < count ? chunk : count); // The calling thread takes the first chunk
+    for (auto& t : pool) t.join();
+}
+
+class ScenarioSet { // One-day relative return scenarios, stored instrument-major so positions stream contiguously
+private:
+    size_t instruments = 0, scenarios = 0;
+    vector<double> returns; // returns[i * scenarios + s]
+
+public:
+    ScenarioSet(size_t instruments, size_t scenarios) : instruments(instruments), scenarios(scenarios), returns(instruments * scenarios) {}
+
+    static ScenarioSet fromHistory(const vector<SimulatedStock*>& market, size_t lookback = 0) { // Historical simulation
+        size_t days = SIZE_MAX;
+        for (auto s : market) days = min(days, s->getHistory().size());
+        size_t count = (market.empty() || days < 2) ? 0 : days - 1; // Returns available for every stock
+        if (lookback && lookback < count) count = lookback;
+        ScenarioSet set(market.size(), count);
+        for (size_t i = 0; i < market.size(); ++i) {
+            const SimulatedStock* stock = market[i];
+            size_t start = stock->getHistory().size() - count - 1; // Align the most recent days
+            for (size_t s = 0; s < count; ++s) set.at(i, s) = stock->adjustedPrice(start + s + 1) / stock->adjustedPrice(start + s) - 1;
+        }
+        return set;
+    }
+
+    static ScenarioSet fromFactorModel(FactorModel& model, size_t paths) { // Monte Carlo simulation
+        ScenarioSet set(model.size(), paths);
+        for (size_t s = 0; s < paths; ++s) {
+            const vector<double>& r = model.generate();
+            for (size_t i = 0; i < r.size(); ++i) set.at(i, s) = r[i];
+        }
+        return set;
+    }
+
+    double& at(size_t instrument, size_t scenario) { return returns[instrument * scenarios + scenario]; }
+    const double* row(size_t instrument) const { return returns.data() + instrument * scenarios; }
+    size_t instrumentCount() const { return instruments; }
+    size_t scenarioCount() const { return scenarios; }
+};
+
+struct RiskReport { // Loss measures of one account, as positive amounts of money
+    double var95 = 0, var99 = 0; // Value-at-Risk
+    double es95 = 0, es99 = 0; // Expected Shortfall, the mean loss beyond VaR
+};
+
+class RiskEngine { // VaR and Expected Shortfall for many accounts in parallel
+public:
+    static RiskReport evaluate(const vector<pair<size_t, double>>& positions, const ScenarioSet& scenarios, vector<double>& losses) {
+        // Positions are (stock ID - 1, exposure) pairs, losses is scratch space for the scenario P&L
+        size_t count = scenarios.scenarioCount();
+        losses.assign(count, 0.0);
+        for (const auto& position : positions) { // Accumulate one position at a time
+            if (position.first >= scenarios.instrumentCount()) continue;
+            double e = position.second;
+            const double* r = scenarios.row(position.first);
+            for (size_t s = 0; s < count; ++s) losses[s] -= e * r[s];
+        }
+        RiskReport report;
+        if (count == 0) return report;
+        // Exact quantiles in linear time, the losses are already in memory so an estimate would only add error
+        auto nth95 = losses.begin() + (size_t)(0.95 * (count - 1) + 0.5), nth99 = losses.begin() + (size_t)(0.99 * (count - 1) + 0.5);
+        nth_element(losses.begin(), nth95, losses.end());
+        report.var95 = *nth95;
+        nth_element(nth95, nth99, losses.end()); // The 99% loss lies above the 95% one
+        report.var99 = *nth99;
+        double tail95 = 0, tail99 = 0;
+        size_t n95 = 0, n99 = 0;
+        for (double loss : losses) {
+            if (loss >= report.var95) { tail95 += loss; ++n95; }
+            if (loss >= report.var99) { tail99 += loss; ++n99; }
+        }
+        report.es95 = n95 ? tail95 / n95 : report.var95;
+        report.es99 = n99 ? tail99 / n99 : report.var99;
+        return report;
+    }
+
+    static RiskReport evaluate(const UserPortfolio& account, const vector<double>& prices, const ScenarioSet& scenarios,
+                               vector<pair<size_t, double>>& positions, vector<double>& losses) {
+        positions.clear();
+        for (const auto& stock : account.getOwnedStocks()) {
+            size_t slot = stock->getId() - 1;
+            if (slot < prices.size()) positions.push_back({slot, stock->getQuantity() * prices[slot]});
+        }
+        return evaluate(positions, scenarios, losses);
+    }
+
+    static vector<RiskReport> evaluate(const vector<const UserPortfolio*>& accounts, const vector<double>& prices,
+                                       const ScenarioSet& scenarios) {
+        vector<RiskReport> reports(accounts.size());
+        parallelFor(accounts.size(), [&](size_t begin, size_t end) {
+            vector<pair<size_t, double>> positions; // Scratch reused by every account of this chunk
+            vector<double> losses;
+            STOCKSIM_TRACE("valuation");
+            for (size_t a = begin; a < end; ++a)
+                reports[a] = evaluate(*accounts[a], prices, scenarios, positions, losses);
+        });
+        return reports;
+    }
+};
+
+class PnlEngine { // P&L for many accounts in parallel
+public:
+    static vector<PnlReport> evaluate(const vector<const UserPortfolio*>& accounts, const vector<double>& prices) {
+        vector<PnlReport> reports(accounts.size());
+        parallelFor(accounts.size(), [&](size_t begin, size_t end) {
+            for (size_t a = begin; a < end; ++a) reports[a] = accounts[a]->getPnl(prices.data(), prices.size());
+        });
+        return reports;
+    }
+
+    static PnlReport total(const vector<PnlReport>& reports) { // Firm-wide sum
+        PnlReport sum;
+        for (const auto& r : reports) {
+            sum.marketValue += r.marketValue;
+            sum.costBasis += r.costBasis;
+            sum.unrealized += r.unrealized;
+            sum.realized += r.realized;
+        }
+        return sum;
+    }
+};
+
+struct RebalanceTrade {
+    uint32_t slot; // Stock ID - 1
+    int quantity; // Shares, positive to buy and negative to sell
+};
+
+struct RebalancePlan { // Trades moving one account towards the target weights
+    vector<RebalanceTrade> trades; // Sells first, then buys
+    double trackingErrorBefore = 0, trackingErrorAfter = 0; // Euclidean distance between actual and target weights
+    double estimatedCost = 0; // Transaction costs of the trades under the cost model
+};
+
+struct TransactionCosts { // Cost model used when deciding whether a trade is worth it
+    double perShare = 0.0; // Commission per share traded
+    double proportional = 0.0005; // Spread and impact as a fraction of traded value
+    double aversion = 20.0; // Weight of cost against tracking error, higher trades less; 20 leaves a band of 0.5% of each target
+};
+
+class Rebalancer { // Integer trades trading off tracking error against transaction costs, for many accounts at once
+private:
+    vector<double> targets; // Target weight per stock ID - 1, the rest stays in cash
+    TransactionCosts costs;
+    double scale = 1.0; // Mean nonzero target weight, puts the linear cost on the same footing as the squared error
+
+    struct Scratch { // Per-worker SoA arrays over the instruments, reused across accounts
+        vector<int64_t> held, shares;
+        vector<double> penalty;
+    };
+
+    double objective(double weight, double target, int64_t trade, double price, double equity) const { // Squared error plus weighted cost
+        // The squared error of a position shrinks with the square of its weight while its cost shrinks only linearly, so
+        // the cost is scaled by the typical weight. Otherwise the band is fixed in weight and swallows whole positions
+        // once the universe is diversified.
+        double d = weight - target;
+        return d * d + costs.aversion * scale * (double)llabs(trade) * (costs.perShare + costs.proportional * price) / equity;
+    }
+
+    RebalancePlan plan(const UserPortfolio& account, const vector<double>& prices, Scratch& s) const {
+        size_t n = prices.size();
+        s.held.assign(n, 0);
+        s.shares.resize(n);
+        s.penalty.resize(n);
+        for (const auto& stock : account.getOwnedStocks()) {
+            size_t slot = stock->getId() - 1;
+            if (slot < n) s.held[slot] = stock->getQuantity();
+        }
+        double cash = account.getBalance(), equity = cash;
+        for (size_t i = 0; i < n; ++i) equity += s.held[i] * prices[i];
+        RebalancePlan result;
+        if (equity <= 0) return result;
+
+        // Continuous optimum per instrument: the target pulled back towards the current weight by half the
+        // scaled cost rate, which leaves a no-trade band proportional to the typical position. Then the best of the two neighbouring share counts and no trade.
+        double before = 0, after = 0, spend = 0;
+        for (size_t i = 0; i < n; ++i) {
+            double p = prices[i], target = i < targets.size() ? targets[i] : 0.0;
+            if (p <= 0) { s.shares[i] = s.held[i]; continue; }
+            double current = s.held[i] * p / equity;
+            double band = 0.5 * costs.aversion * scale * (costs.proportional + costs.perShare / p);
+            double goal = current < target - band ? target - band : current > target + band ? target + band : current;
+            double exact = max(goal, 0.0) * equity / p;
+            int64_t best = s.held[i];
+            double bestValue = objective(current, target, 0, p, equity);
+            for (int64_t candidate : {(int64_t)floor(exact), (int64_t)ceil(exact)}) {
+                double value = objective(candidate * p / equity, target, candidate - s.held[i], p, equity);
+                if (candidate >= 0 && value < bestValue) { best = candidate; bestValue = value; }
+            }
+            s.shares[i] = best;
+            spend += (best - s.held[i]) * p;
+            before += (current - target) * (current - target);
+        }
+
+        // Rounding up and costs can overdraw the cash, give back the buys that help least per dollar
+        auto cost = [&](size_t i) { return (double)llabs(s.shares[i] - s.held[i]) * (costs.perShare + costs.proportional * prices[i]); };
+        double totalCost = 0;
+        for (size_t i = 0; i < n; ++i) totalCost += cost(i);
+        while (spend + totalCost > cash) {
+            size_t worst = n;
+            double worstLoss = 0;
+            for (size_t i = 0; i < n; ++i) {
+                if (s.shares[i] <= s.held[i]) continue;
+                double target = i < targets.size() ? targets[i] : 0.0, p = prices[i];
+                double loss = (objective((s.shares[i] - 1) * p / equity, target, s.shares[i] - 1 - s.held[i], p, equity)
+                             - objective(s.shares[i] * p / equity, target, s.shares[i] - s.held[i], p, equity)) / p;
+                if (worst == n || loss < worstLoss) { worst = i; worstLoss = loss; }
+            }
+            if (worst == n) break; // Nothing left to give back
+            totalCost -= cost(worst);
+            --s.shares[worst];
+            totalCost += cost(worst);
+            spend -= prices[worst];
+        }
+
+        for (int pass = 0; pass < 2; ++pass) // Sells free the cash the buys need
+            for (size_t i = 0; i < n; ++i) {
+                int64_t trade = s.shares[i] - s.held[i];
+                if (pass == 0 ? trade < 0 : trade > 0) result.trades.push_back({(uint32_t)i, (int)trade});
+            }
+        for (size_t i = 0; i < n; ++i) {
+            double d = s.shares[i] * prices[i] / equity - (i < targets.size() ? targets[i] : 0.0);
+            after += d * d;
+        }
+        result.trackingErrorBefore = sqrt(before);
+        result.trackingErrorAfter = sqrt(after);
+        result.estimatedCost = totalCost;
+        return result;
+    }
+
+public:
+    Rebalancer(vector<double> targetWeights, TransactionCosts costs = TransactionCosts()) : targets(move(targetWeights)), costs(costs) {
+        double sum = 0;
+        size_t held = 0;
+        for (double t : targets)
+            if (t > 0) { sum += t; ++held; }
+        if (held) scale = sum / held;
+    }
+
+    static vector<double> equalWeights(size_t count, double invested = 1.0) { return vector<double>(count, count ? invested / count : 0.0); }
+
+    RebalancePlan plan(const UserPortfolio& account, const vector<double>& prices) const {
+        Scratch s;
+        return plan(account, prices, s);
+    }
+
+    vector<RebalancePlan> planAll(const vector<const UserPortfolio*>& accounts, const vector<double>& prices) const { // Nightly batch
+        vector<RebalancePlan> plans(accounts.size());
+        parallelFor(accounts.size(), [&](size_t begin, size_t end) {
+            Scratch s;
+            for (size_t a = begin; a < end; ++a) plans[a] = plan(*accounts[a], prices, s);
+        });
+        return plans;
+    }
+
+    static size_t applyTrades(UserPortfolio& account, const RebalancePlan& plan, const vector<SimulatedStock*>& market,
+                              const vector<double>& prices) { // Execute at the planned prices, returns the trades that filled
+        size_t filled = 0;
+        for (const auto& t : plan.trades) {
+            if (t.slot >= market.size() || t.slot >= prices.size()) continue;
+            TradeStatus status = t.quantity > 0 ? account.applyBuy(market[t.slot], t.quantity, prices[t.slot])
+                                                : account.applySell(market[t.slot]->getId(), -t.quantity, prices[t.slot]);
+            if (status == TradeStatus::Ok) ++filled;
+        }
+        return filled;
+    }
+};
+
+class PriceTable { // Read-only daily prices, day-major, shared by concurrent readers
+private:
+    vector<double> storage; // Owned prices, empty when viewing external memory
+    const double* data = nullptr; // prices of day d start at data[d * instruments]
+    size_t days = 0, instruments = 0;
+
+public:
+    PriceTable() {}
+    PriceTable(vector<double> values, size_t instruments)
+        : storage(move(values)), data(storage.data()), days(instruments ? storage.size() / instruments : 0), instruments(instruments) {}
+    PriceTable(const double* external, size_t days, size_t instruments) : data(external), days(days), instruments(instruments) {}
+    PriceTable(PriceTable&& other) noexcept { *this = move(other); }
+
+    PriceTable& operator=(PriceTable&& other) noexcept {
+        bool owned = other.data == other.storage.data();
+        storage = move(other.storage);
+        data = owned ? storage.data() : other.data;
+        days = other.days;
+        instruments = other.instruments;
+        return *this;
+    }
+
+    static PriceTable fromHistory(const vector<SimulatedStock*>& market) { // Most recent days common to every stock
+        size_t count = SIZE_MAX;
+        for (auto s : market) count = min(count, s->getHistory().size());
+        if (market.empty()) count = 0;
+        vector<double> values(count * market.size());
+        for (size_t i = 0; i < market.size(); ++i) { // Split and dividend adjusted
+            size_t first = market[i]->getHistory().size() - count;
+            for (size_t d = 0; d < count; ++d) values[d * market.size() + i] = market[i]->adjustedPrice(first + d);
+        }
+        return PriceTable(move(values), market.size());
+    }
+
+    const double* day(size_t d) const { return data + d * instruments; } // Prices of one day, indexed by stock ID - 1
+    size_t dayCount() const { return days; }
+    size_t instrumentCount() const { return instruments; }
+};
+
+struct FrontierPoint { // One long-only portfolio on the efficient frontier, daily figures
+    vector<double> weights; // Per stock ID - 1, non-negative and summing to 1
+    double tradeoff = 0; // Return weight against variance that produced it, 0 for minimum variance
+    double expectedReturn = 0, volatility = 0;
+    double sharpe = 0; // (expectedReturn - risk-free) / volatility
+};
+
+class MeanVarianceOptimizer { // Long-only Markowitz portfolios from a dense covariance of daily log returns
+private:
+    static constexpr size_t block = 64; // Instruments per tile in the covariance kernel
+    static constexpr size_t dayBlock = 256; // Days per tile, a pair of tiles stays in L2 cache
+    static constexpr size_t parallelRows = 512; // Smaller products are not worth the threads
+    size_t count = 0;
+    vector<double> mu; // Mean daily log return
+    vector<double> sigma; // Full symmetric covariance, row-major count x count
+    vector<double> returns; // Demeaned returns, instrument-major, kept when there are far fewer days than instruments
+    size_t days = 0; // Columns of returns
+    double lipschitz = 0; // Largest eigenvalue of sigma, bounds the gradient step
+
+    void multiply(const vector<double>& w, vector<double>& out) const { // out = sigma * w
+        out.resize(count);
+        auto run = [&](size_t n, auto fn) {
+            if (count < parallelRows) fn(0, n);
+            else parallelFor(n, fn);
+        };
+        if (!returns.empty()) { // sigma = X'X / (days - 1), two thin products instead of one square one
+            vector<double> xw(days);
+            run(days, [&](size_t begin, size_t end) { // Each worker owns a range of days
+                for (size_t i = 0; i < count; ++i) {
+                    const double* x = returns.data() + i * days;
+                    for (size_t d = begin; d < end; ++d) xw[d] += w[i] * x[d];
+                }
+            });
+            double scale = 1.0 / (days - 1);
+            run(count, [&](size_t begin, size_t end) {
+                for (size_t i = begin; i < end; ++i) {
+                    const double* x = returns.data() + i * days;
+                    double sum = 0;
+                    for (size_t d = 0; d < days; ++d) sum += x[d] * xw[d];
+                    out[i] = sum * scale;
+                }
+            });
+            return;
+        }
+        run(count, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                const double* row = sigma.data() + i * count;
+                double sum = 0;
+                for (size_t j = 0; j < count; ++j) sum += row[j] * w[j];
+                out[i] = sum;
+            }
+        });
+    }
+
+    double largestEigenvalue(size_t iterations = 100) const { // Power iteration
+        if (count == 0) return 0;
+        vector<double> v(count, 1.0 / sqrt((double)count)), next;
+        double lambda = 0;
+        for (size_t k = 0; k < iterations; ++k) {
+            multiply(v, next);
+            double norm = 0;
+            for (double x : next) norm += x * x;
+            norm = sqrt(norm);
+            if (norm == 0) return 0;
+            for (size_t i = 0; i < count; ++i) v[i] = next[i] / norm;
+            if (fabs(norm - lambda) <= 1e-9 * norm) return norm;
+            lambda = norm;
+        }
+        return lambda;
+    }
+
+    static void projectToSimplex(vector<double>& w, vector<double>& sorted) { // Closest point with w >= 0 and sum 1
+        sorted = w;
+        sort(sorted.begin(), sorted.end(), greater<double>());
+        double sum = 0, theta = 0;
+        for (size_t k = 0; k < sorted.size(); ++k) {
+            sum += sorted[k];
+            double t = (sum - 1.0) / (k + 1);
+            if (sorted[k] - t > 0) theta = t;
+        }
+        for (double& x : w) x = max(x - theta, 0.0);
+    }
+
+    static void projectToBudget(vector<double>& y, const vector<double>& excess) { // Closest point with y >= 0 and excess'y = 1
+        auto budget = [&](double theta) {
+            double sum = 0;
+            for (size_t i = 0; i < y.size(); ++i) sum += excess[i] * max(y[i] - theta * excess[i], 0.0);
+            return sum;
+        };
+        double lo = -1.0, hi = 1.0; // budget() falls as theta grows, bracket the root then bisect
+        while (budget(lo) < 1.0) lo *= 2;
+        while (budget(hi) > 1.0) hi *= 2;
+        for (int k = 0; k < 100 && hi - lo > 1e-15 * (fabs(lo) + fabs(hi)); ++k) {
+            double mid = 0.5 * (lo + hi);
+            (budget(mid) > 1.0 ? lo : hi) = mid;
+        }
+        double theta = 0.5 * (lo + hi);
+        for (size_t i = 0; i < y.size(); ++i) y[i] = max(y[i] - theta * excess[i], 0.0);
+    }
+
+    template <typename Project>
+    vector<double> minimize(vector<double> w, const vector<double>& linear, Project project, size_t maxIterations, double tolerance) const {
+        // Minimise w'Sw / 2 - linear'w over a convex set with accelerated projected gradient (FISTA), restarting the
+        // momentum whenever it points uphill. Stops once a step moves the weights by less than tolerance relative to their size.
+        vector<double> y = w, previous, gradient;
+        double step = 1.0 / lipschitz, t = 1.0;
+        for (size_t k = 0; k < maxIterations; ++k) {
+            multiply(y, gradient);
+            previous = w;
+            for (size_t i = 0; i < count; ++i) w[i] = y[i] - step * (gradient[i] - linear[i]);
+            project(w);
+            double uphill = 0, change = 0, size = 0;
+            for (size_t i = 0; i < count; ++i) {
+                double delta = w[i] - previous[i];
+                uphill += (y[i] - w[i]) * delta;
+                change += delta * delta;
+                size += w[i] * w[i];
+            }
+            if (change <= tolerance * tolerance * size) break;
+            if (uphill > 0) t = 1.0; // Gradient restart
+            double nextT = 0.5 * (1.0 + sqrt(1.0 + 4.0 * t * t)), momentum = (t - 1.0) / nextT;
+            for (size_t i = 0; i < count; ++i) y[i] = w[i] + momentum * (w[i] - previous[i]);
+            t = nextT;
+        }
+        return w;
+    }
+
+    FrontierPoint describe(vector<double> w, double tradeoff, double riskFree) const {
+        FrontierPoint p;
+        vector<double> sw;
+        multiply(w, sw);
+        double variance = 0;
+        for (size_t i = 0; i < count; ++i) {
+            p.expectedReturn += w[i] * mu[i];
+            variance += w[i] * sw[i];
+        }
+        p.volatility = sqrt(max(variance, 0.0));
+        p.sharpe = p.volatility > 0 ? (p.expectedReturn - riskFree) / p.volatility : 0.0;
+        p.tradeoff = tradeoff;
+        p.weights = move(w);
+        return p;
+    }
+
+public:
+    MeanVarianceOptimizer(vector<double> covariance, vector<double> expectedReturns) // Covariance is full and row-major
+        : count(expectedReturns.size()), mu(move(expectedReturns)), sigma(move(covariance)) {
+        if (sigma.size() != count * count) throw runtime_error("covariance does not match the expected returns");
+        lipschitz = largestEigenvalue();
+    }
+
+    static MeanVarianceOptimizer fromHistory(const PriceTable& table) { // Sample covariance, tiled over instruments and days
+        size_t n = table.instrumentCount(), days = table.dayCount() > 0 ? table.dayCount() - 1 : 0;
+        vector<double> mean(n), returns(n * days); // Instrument-major, each instrument's returns are contiguous
+        for (size_t d = 0; d < days; ++d) {
+            const double* today = table.day(d), *tomorrow = table.day(d + 1);
+            for (size_t i = 0; i < n; ++i) {
+                double r = today[i] > 0 && tomorrow[i] > 0 ? log(tomorrow[i] / today[i]) : 0.0;
+                returns[i * days + d] = r;
+                mean[i] += r;
+            }
+        }
+        for (size_t i = 0; i < n; ++i) {
+            mean[i] = days ? mean[i] / days : 0.0;
+            for (size_t d = 0; d < days; ++d) returns[i * days + d] -= mean[i];
+        }
+
+        vector<double> covariance(n * n);
+        size_t blocks = (n + block - 1) / block;
+        double scale = days > 1 ? 1.0 / (days - 1) : 0.0;
+        parallelFor(blocks, [&](size_t first, size_t last) { // Each worker owns whole row tiles of the upper triangle
+            for (size_t ib = first * block; ib < min(last * block, n); ib += block)
+                for (size_t jb = ib; jb < n; jb += block)
+                    for (size_t db = 0; db < days; db += dayBlock) {
+                        size_t iEnd = min(ib + block, n), jEnd = min(jb + block, n), dEnd = min(db + dayBlock, days);
+                        for (size_t i = ib; i < iEnd; ++i) {
+                            const double* x = returns.data() + i * days;
+                            for (size_t j = max(i, jb); j < jEnd; ++j) {
+                                const double* y = returns.data() + j * days;
+                                double sum = 0;
+                                for (size_t d = db; d < dEnd; ++d) sum += x[d] * y[d]; // Contiguous, vectorized by the compiler
+                                covariance[i * n + j] += sum;
+                            }
+                        }
+                    }
+        });
+        for (size_t i = 0; i < n; ++i) // Scale and mirror the upper triangle
+            for (size_t j = i; j < n; ++j) covariance[j * n + i] = covariance[i * n + j] *= scale;
+        MeanVarianceOptimizer optimizer(move(covariance), move(mean));
+        if (days > 1 && 2 * days < n) { // Products through the returns are cheaper than through the square matrix
+            optimizer.returns = move(returns);
+            optimizer.days = days;
+        }
+        return optimizer;
+    }
+
+    size_t size() const { return count; }
+    double covariance(size_t i, size_t j) const { return sigma[i * count + j]; }
+    double expectedReturn(size_t i) const { return mu[i]; }
+
+    FrontierPoint solve(double tradeoff, double riskFree = 0.0, const vector<double>* start = nullptr,
+                        size_t maxIterations = 5000, double tolerance = 1e-6) const { // Minimise w'Sw / 2 - tradeoff * mu'w, long-only
+        vector<double> w = start && start->size() == count ? *start : vector<double>(count, count ? 1.0 / count : 0.0);
+        if (count == 0 || lipschitz <= 0) return describe(move(w), tradeoff, riskFree);
+        vector<double> linear(count), scratch;
+        for (size_t i = 0; i < count; ++i) linear[i] = tradeoff * mu[i];
+        w = minimize(move(w), linear, [&](vector<double>& v) { projectToSimplex(v, scratch); }, maxIterations, tolerance);
+        return describe(move(w), tradeoff, riskFree);
+    }
+
+    FrontierPoint minimumVariance() const { return solve(0.0); }
+
+    vector<FrontierPoint> frontier(size_t points = 20, double riskFree = 0.0) const { // From minimum variance to the best single name
+        double maxVariance = 0, best = -HUGE_VAL, average = 0;
+        for (size_t i = 0; i < count; ++i) {
+            maxVariance = max(maxVariance, sigma[i * count + i]);
+            best = max(best, mu[i]);
+            average += mu[i] / count;
+        }
+        double top = best > average ? 2.0 * maxVariance / (best - average) : 0.0; // Past this the answer is a corner
+        vector<FrontierPoint> result;
+        for (size_t k = 0; k < points; ++k) { // Each point starts from the previous one
+            double tradeoff = points > 1 ? top * k / (points - 1) : 0.0;
+            result.push_back(solve(tradeoff, riskFree, result.empty() ? nullptr : &result.back().weights));
+        }
+        return result;
+    }
+
+    FrontierPoint maxSharpe(double riskFree = 0.0, size_t maxIterations = 5000, double tolerance = 1e-6) const {
+        // Long-only tangency portfolio in one solve: minimise y'Sy / 2 with excess'y = 1 and y >= 0, then scale y to sum to 1
+        vector<double> excess(count), y(count);
+        double best = -HUGE_VAL;
+        size_t top = 0;
+        for (size_t i = 0; i < count; ++i) {
+            excess[i] = mu[i] - riskFree;
+            if (excess[i] > best) { best = excess[i]; top = i; }
+        }
+        if (count == 0 || best <= 0 || lipschitz <= 0) return solve(0.0, riskFree); // Nothing beats the risk-free rate, fall back to minimum variance
+        y[top] = 1.0 / best; // Feasible start, all in the best name
+        y = minimize(move(y), vector<double>(count), [&](vector<double>& v) { projectToBudget(v, excess); }, maxIterations, tolerance);
+        double total = 0;
+        for (double v : y) total += v;
+        for (double& v : y) v /= total;
+        FrontierPoint p = describe(move(y), 0.0, riskFree);
+        p.tradeoff = p.volatility > 0 ? p.volatility * p.volatility / (p.expectedReturn - riskFree) : 0.0; // Where it sits on the frontier
+        return p;
+    }
+};
+
+class BacktestContext { // View of one replayed day given to a strategy
+private:
+    UserPortfolio& portfolio; // Account the strategy trades in
+    const vector<SimulatedStock*>& instruments; // Market metadata, indexed like the prices
+    size_t trades = 0; // Filled orders so far
+
+public:
+    size_t day = 0; // Current day of the replay
+    const double* prices = nullptr; // Prices of the current day
+
+    BacktestContext(UserPortfolio& portfolio, const vector<SimulatedStock*>& instruments)
+        : portfolio(portfolio), instruments(instruments) {}
+
+    bool buy(size_t slot, int qty) { // Orders fill at the current day's price
+        if (qty <= 0 || portfolio.applyBuy(instruments[slot], qty, prices[slot]) != TradeStatus::Ok) return false;
+        ++trades;
+        return true;
+    }
+
+    bool sell(size_t slot, int qty) {
+        if (qty <= 0 || portfolio.applySell(instruments[slot]->getId(), qty, prices[slot]) != TradeStatus::Ok) return false;
+        ++trades;
+        return true;
+    }
+
+    int position(size_t slot) const { // Quantity currently held
+        for (const auto& stock : portfolio.getOwnedStocks())
+            if (stock->getId() == instruments[slot]->getId()) return stock->getQuantity();
+        return 0;
+    }
+
+    double cash() const { return portfolio.getBalance(); }
+    size_t instrumentCount() const { return instruments.size(); }
+    size_t tradeCount() const { return trades; }
+};
+
+class Strategy { // Trading logic driven by the backtester (abstract)
+public:
+    virtual ~Strategy() {}
+    virtual string getName() const = 0;
+    virtual void onDay(BacktestContext& context) = 0; // Called once per replayed day
+};
+
+class BuyAndHoldStrategy : public Strategy { // Spend the balance equally across the market on the first day
+public:
+    string getName() const override { return "Buy and hold"; }
+
+    void onDay(BacktestContext& context) override {
+        if (context.day != 0) return;
+        double budget = context.cash() / context.instrumentCount();
+        for (size_t i = 0; i < context.instrumentCount(); ++i)
+            context.buy(i, (int)(budget / context.prices[i]));
+    }
+};
+
+class MovingAverageCrossStrategy : public Strategy { // Hold a stock while its fast average is above its slow average
+private:
+    size_t fast, slow; // Window lengths in days
+    double allocation; // Share of the cash spent on each entry
+    vector<double> fastSum, slowSum; // Running window sums per instrument
+    vector<vector<double>> recent; // Last slow prices per instrument
+
+public:
+    MovingAverageCrossStrategy(size_t fast, size_t slow, double allocation = 0.1)
+        : fast(fast ? fast : 1), slow(slow > this->fast ? slow : this->fast + 1), allocation(allocation) {} // A zero-day average would divide by zero
+
+    string getName() const override { return "MA cross " + to_string(fast) + "/" + to_string(slow); }
+
+    void onDay(BacktestContext& context) override {
+        size_t n = context.instrumentCount();
+        if (recent.empty()) { fastSum.assign(n, 0); slowSum.assign(n, 0); recent.assign(n, vector<double>(slow)); }
+        size_t d = context.day;
+        for (size_t i = 0; i < n; ++i) {
+            double p = context.prices[i];
+            vector<double>& ring = recent[i];
+            fastSum[i] += p - (d >= fast ? ring[(d - fast) % slow] : 0.0);
+            slowSum[i] += p - (d >= slow ? ring[d % slow] : 0.0);
+            ring[d % slow] = p;
+            if (d + 1 < slow) continue; // Wait for a full slow window
+            bool bullish = fastSum[i] / fast > slowSum[i] / slow;
+            int held = context.position(i);
+            if (bullish && held == 0) context.buy(i, (int)(context.cash() * allocation / p));
+            else if (!bullish && held > 0) context.sell(i, held);
+        }
+    }
+};
+
+struct BacktestResult { // Outcome of one strategy run
+    string name;
+    double finalValue = 0; // Cash plus holdings at the last day's prices
+    double totalReturn = 0; // Relative to the initial balance
+    double maxDrawdown = 0; // Largest peak-to-trough fall of the account value
+    size_t trades = 0;
+};
+
+class Backtester { // Replays shared price data through many strategies in parallel
+private:
+    const PriceTable& prices;
+    const vector<SimulatedStock*>& instruments;
+    double initialBalance;
+
+public:
+    static constexpr double defaultCapital = 3000.0; // Same as a new account, so runs compare across sessions
+
+    Backtester(const PriceTable& prices, const vector<SimulatedStock*>& instruments, double initialBalance = defaultCapital)
+        : prices(prices), instruments(instruments), initialBalance(initialBalance) {
+        if (!(initialBalance > 0)) throw runtime_error("backtest needs a positive initial balance"); // Returns divide by it
+    }
+
+    BacktestResult run(Strategy& strategy) const { // One replay on the calling thread
+        STOCKSIM_TRACE("backtest");
+        UserPortfolio portfolio(initialBalance);
+        BacktestContext context(portfolio, instruments);
+        BacktestResult result;
+        result.name = strategy.getName();
+        double peak = initialBalance;
+        for (size_t d = 0; d < prices.dayCount(); ++d) {
+            context.day = d;
+            context.prices = prices.day(d);
+            strategy.onDay(context);
+            double value = portfolio.getBalance() + portfolio.getMarketValue(context.prices, prices.instrumentCount());
+            if (value > peak) peak = value;
+            if (peak > 0 && (peak - value) / peak > result.maxDrawdown) result.maxDrawdown = (peak - value) / peak;
+            result.finalValue = value;
+        }
+        result.totalReturn = result.finalValue / initialBalance - 1;
+        result.trades = context.tradeCount();
+        return result;
+    }
+
+    vector<BacktestResult> run(const vector<function<unique_ptr<Strategy>()>>& factories) const { // One run per factory, in parallel
+        vector<BacktestResult> results(factories.size());
+        parallelFor(factories.size(), [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                unique_ptr<Strategy> strategy = factories[i]();
+                results[i] = run(*strategy);
+            }
+        });
+        return results;
+    }
+
+    static BacktestResult best(const vector<BacktestResult>& results) { // Aggregate, highest final value
+        BacktestResult top;
+        top.finalValue = -1;
+        for (const auto& r : results) if (r.finalValue > top.finalValue) top = r;
+        return top;
+    }
+};
+
+class MarketDefinition { // Immutable instrument list in SoA form, names packed into one buffer
+private:
+    vector<int> ids; // Stock IDs, 1..n in order
+    vector<double> prices; // Initial prices
+    vector<uint8_t> risks; // Risk level indices, see VolatilityProfile
+    string nameData; // All names back to back
+    vector<uint32_t> nameOffsets{0}; // Name i is nameData[nameOffsets[i], nameOffsets[i + 1])
+
+    friend class MarketLoader; // Fills the arrays directly
+
+public:
+    void reserve(size_t count, size_t nameBytes) {
+        ids.reserve(count); prices.reserve(count); risks.reserve(count);
+        nameOffsets.reserve(count + 1); nameData.reserve(nameBytes);
+    }
+
+    void add(int id, string_view name, double price, uint8_t risk) {
+        ids.push_back(id);
+        prices.push_back(price);
+        risks.push_back(risk);
+        nameData.append(name);
+        nameOffsets.push_back((uint32_t)nameData.size());
+    }
+
+    static MarketDefinition fromStocks(const vector<SimulatedStock*>& market) {
+        MarketDefinition def;
+        for (auto s : market) def.add(s->getId(), s->getName(), s->getPrice(), VolatilityProfile::riskIndex(s->getRiskLevel()));
+        return def;
+    }
+
+    vector<SimulatedStock*> makeStocks() const { // Caller owns the returned stocks
+        vector<SimulatedStock*> market;
+        market.reserve(size());
+        for (size_t i = 0; i < size(); ++i)
+            market.push_back(new SimulatedStock(ids[i], string(name(i)), prices[i], VolatilityProfile::riskName(risks[i])));
+        return market;
+    }
+
+    size_t size() const { return ids.size(); }
+    int id(size_t i) const { return ids[i]; }
+    double price(size_t i) const { return prices[i]; }
+    uint8_t risk(size_t i) const { return risks[i]; }
+    string_view name(size_t i) const { return string_view(nameData).substr(nameOffsets[i], nameOffsets[i + 1] - nameOffsets[i]); }
+    const vector<double>& getPrices() const { return prices; }
+    const vector<uint8_t>& getRisks() const { return risks; }
+};
+
+class MappedFile { // Read-only memory mapping of a whole file
+private:
+    const char* bytes = nullptr;
+    size_t length = 0;
+
+public:
+    explicit MappedFile(const string& path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) throw runtime_error("cannot open " + path);
+        struct stat info;
+        if (fstat(fd, &info) != 0) { close(fd); throw runtime_error("cannot stat " + path); }
+        length = info.st_size;
+        if (length > 0) {
+            void* mapped = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped == MAP_FAILED) { close(fd); throw runtime_error("cannot map " + path); }
+            bytes = (const char*)mapped;
+        }
+        close(fd); // The mapping keeps the file alive
+    }
+
+    ~MappedFile() { if (bytes) munmap((void*)bytes, length); }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* data() const { return bytes; }
+    size_t size() const { return length; }
+    void advise(size_t offset, size_t count, int advice) const { // madvise() on a range, rounded to pages
+        if (!bytes || offset >= length) return;
+        size_t page = sysconf(_SC_PAGESIZE), begin = offset / page * page;
+        size_t end = min(offset + count, length);
+        madvise((void*)(bytes + begin), end - begin, advice);
+    }
+};
+
+inline const char* scanFor(const char* p, const char* end, char c) { // First c in [p, end), or end
+#ifdef __SSE2__
+    __m128i needle = _mm_set1_epi8(c);
+    for (; p + 16 <= end; p += 16) { // Compare 16 bytes at a time
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)p), needle));
+        if (mask) return p + __builtin_ctz(mask);
+    }
+#endif
+    while (p < end && *p != c) ++p;
+    return p;
+}
+
+class MarketLoader { // Builds a MarketDefinition from CSV or binary instrument files
+private:
+    static constexpr char magic[4] = {'S', 'S', 'M', 'D'};
+
+    struct BinaryHeader { // Followed by ids, prices, risks, name offsets and name bytes
+        char magic[4];
+        uint32_t version;
+        uint64_t count;
+        uint64_t nameBytes;
+    };
+
+    static string_view nextField(const char*& p, const char* end) { // Field up to the next comma, p moves past it
+        const char* comma = scanFor(p, end, ',');
+        string_view field(p, comma - p);
+        p = comma < end ? comma + 1 : end;
+        return field;
+    }
+
+public:
+    static MarketDefinition loadCsv(const string& path) { // Rows of id,name,price,risk with IDs 1..n, optional header
+        MappedFile file(path);
+        file.advise(0, file.size(), MADV_SEQUENTIAL);
+        const char* p = file.data();
+        const char* end = p + file.size();
+        MarketDefinition def;
+        def.reserve(file.size() / 24, file.size() / 2); // Rough guess from a typical row length
+        size_t line = 0;
+        while (p < end) {
+            const char* eol = scanFor(p, end, '\n');
+            const char* next = eol < end ? eol + 1 : end;
+            if (eol > p && eol[-1] == '\r') --eol; // Accept CRLF files
+            ++line;
+            if (eol == p || (line == 1 && (*p < '0' || *p > '9'))) { p = next; continue; } // Blank line or header
+            int id = 0;
+            double price = 0;
+            string_view idField = nextField(p, eol), name = nextField(p, eol), priceField = nextField(p, eol), risk(p, eol - p);
+            auto idResult = from_chars(idField.data(), idField.data() + idField.size(), id);
+            auto priceResult = from_chars(priceField.data(), priceField.data() + priceField.size(), price);
+            if (idResult.ec != errc() || idResult.ptr != idField.data() + idField.size() || priceResult.ec != errc()
+                || priceResult.ptr != priceField.data() + priceField.size() || risk.empty() || risk.find(',') != string_view::npos)
+                throw runtime_error(path + ":" + to_string(line) + ": expected id,name,price,risk");
+            if (id != (int)def.size() + 1)
+                throw runtime_error(path + ":" + to_string(line) + ": stock IDs must be 1..n in order");
+            if (!isfinite(price) || price <= 0)
+                throw runtime_error(path + ":" + to_string(line) + ": price must be a positive number");
+            uint8_t riskIndex;
+            if (risk.size() == 1 && risk[0] >= '0' && risk[0] <= '2') riskIndex = risk[0] - '0';
+            else if (risk == "Low" || risk == "Medium" || risk == "High") riskIndex = VolatilityProfile::riskIndex(risk);
+            else throw runtime_error(path + ":" + to_string(line) + ": risk must be Low, Medium, High or 0-2, got '" + string(risk) + "'");
+            def.add(id, name, price, riskIndex);
+            p = next;
+        }
+        return def;
+    }
+
+    static MarketDefinition loadBinary(const string& path) { // Arrays are copied straight into the SoA vectors
+        MappedFile file(path);
+        BinaryHeader header;
+        if (file.size() < sizeof header) throw runtime_error(path + ": truncated header");
+        memcpy(&header, file.data(), sizeof header);
+        if (memcmp(header.magic, magic, 4) != 0 || header.version != 1) throw runtime_error(path + ": not a market file");
+        if (file.size() < sizeof header + sizeof(uint32_t)) throw runtime_error(path + ": truncated data"); // Even an empty market has its end offset
+        size_t perStock = sizeof(int32_t) + sizeof(double) + 1 + sizeof(uint32_t);
+        size_t room = file.size() - sizeof header - sizeof(uint32_t); // Both counts are bounded by the file before multiplying
+        if (header.count > room / perStock || header.nameBytes > room) throw runtime_error(path + ": truncated data");
+        size_t n = header.count;
+        size_t expected = sizeof header + n * perStock + sizeof(uint32_t) + header.nameBytes;
+        if (file.size() < expected) throw runtime_error(path + ": truncated data");
+        MarketDefinition def;
+        const char* p = file.data() + sizeof header;
+        auto copyArray = [&p](auto& target, size_t count) {
+            target.resize(count);
+            memcpy(target.data(), p, count * sizeof(target[0]));
+            p += count * sizeof(target[0]);
+        };
+        copyArray(def.ids, n);
+        copyArray(def.prices, n);
+        copyArray(def.risks, n);
+        copyArray(def.nameOffsets, n + 1);
+        def.nameData.assign(p, header.nameBytes);
+        for (size_t i = 0; i < n; ++i) { // Same rules as the CSV loader, and names must lie inside the name buffer
+            if (def.ids[i] != (int)i + 1) throw runtime_error(path + ": stock IDs must be 1..n in order");
+            if (!isfinite(def.prices[i]) || def.prices[i] <= 0) throw runtime_error(path + ": price of stock " + to_string(i + 1) + " is not positive");
+            if (def.risks[i] > 2) throw runtime_error(path + ": risk of stock " + to_string(i + 1) + " is out of range");
+            if (def.nameOffsets[i] > def.nameOffsets[i + 1]) throw runtime_error(path + ": name offsets out of order");
+        }
+        if (def.nameOffsets[0] != 0 || def.nameOffsets[n] > header.nameBytes) throw runtime_error(path + ": name offsets out of range");
+        return def;
+    }
+
+    static void saveBinary(const MarketDefinition& def, const string& path) {
+        ofstream out(path, ios::binary);
+        if (!out) throw runtime_error("cannot write " + path);
+        BinaryHeader header;
+        memcpy(header.magic, magic, 4);
+        header.version = 1;
+        header.count = def.size();
+        header.nameBytes = def.nameData.size();
+        out.write((const char*)&header, sizeof header);
+        out.write((const char*)def.ids.data(), def.ids.size() * sizeof(int32_t));
+        out.write((const char*)def.prices.data(), def.prices.size() * sizeof(double));
+        out.write((const char*)def.risks.data(), def.risks.size());
+        out.write((const char*)def.nameOffsets.data(), def.nameOffsets.size() * sizeof(uint32_t));
+        out.write(def.nameData.data(), def.nameData.size());
+        out.close();
+        if (!out) throw runtime_error("cannot write " + path);
+    }
+
+    static MarketDefinition load(const string& path) { // Binary files are recognized by their magic bytes
+        {
+            MappedFile file(path);
+            if (file.size() >= 4 && memcmp(file.data(), magic, 4) == 0) return loadBinary(path);
+        }
+        return loadCsv(path);
+    }
+};
+
+class WorkStealingPool { // Runs a batch of tasks, idle workers steal from the front of busy workers' queues
+private:
+    struct Worker {
+        mutex lock; // Guards tasks, only contended while stealing
+        deque<function<void()>> tasks;
+    };
+    vector<unique_ptr<Worker>> workers;
+    size_t next = 0; // Round-robin target for submit()
+
+    bool take(size_t self, function<void()>& task) { // Own queue from the back, then others from the front
+        {
+            lock_guard<mutex> guard(workers[self]->lock);
+            if (!workers[self]->tasks.empty()) {
+                task = move(workers[self]->tasks.back());
+                workers[self]->tasks.pop_back();
+                return true;
+            }
+        }
+        for (size_t k = 1; k < workers.size(); ++k) {
+            Worker& victim = *workers[(self + k) % workers.size()];
+            lock_guard<mutex> guard(victim.lock);
+            if (!victim.tasks.empty()) {
+                task = move(victim.tasks.front());
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+public:
+    explicit WorkStealingPool(size_t threads = 0) {
+        if (threads == 0) threads = thread::hardware_concurrency();
+        if (threads == 0) threads = 1;
+        for (size_t i = 0; i < threads; ++i) workers.push_back(make_unique<Worker>());
+    }
+
+    void submit(function<void()> task) { // Queue a task before run()
+        workers[next]->tasks.push_back(move(task));
+        next = (next + 1) % workers.size();
+    }
+
+    void run() { // Execute every queued task, returns when all are done
+        auto loop = [this](size_t self) {
+            function<void()> task;
+            while (take(self, task)) task(); // Tasks do not submit more work, so empty queues mean done
+        };
+        vector<thread> pool;
+        for (size_t i = 1; i < workers.size(); ++i) pool.emplace_back(loop, i);
+        loop(0);
+        for (auto& t : pool) t.join();
+    }
+};
+
+struct SimulationConfig { // One point of a parameter sweep
+    VolatilityProfile volatility; // Daily volatility per risk level
+    double initialBalance = 3000.0; // Invested equally across the market on day 0
+    size_t days = 250; // Simulated days per path
+    size_t paths = 100; // Independent paths
+    uint64_t seed = 1;
+};
+
+struct SweepSummary { // Statistics of the final account value over all paths of a configuration
+    SimulationConfig config;
+    double mean = 0, stddev = 0, min = 0, max = 0;
+    double meanReturn = 0;
+};
+
+class SweepRunner { // Runs many simulation configurations over one shared market definition
+private:
+    const MarketDefinition& market;
+    static constexpr size_t pathsPerTask = 8; // Granularity of the work-stealing tasks
+
+    double simulatePath(const SimulationConfig& config, uint64_t path) const { // Equal-weight buy and hold over one random path
+        mt19937_64 rng(config.seed * 0x9E3779B97F4A7C15ull + path);
+        uniform_int_distribution<int> step(0, 200); // Same moves as SimulatedStock::updatePrice()
+        size_t n = market.size();
+        vector<double> price(market.getPrices());
+        double vol[3] = {config.volatility.forIndex(0), config.volatility.forIndex(1), config.volatility.forIndex(2)};
+        for (size_t d = 0; d < config.days; ++d)
+            for (size_t i = 0; i < n; ++i) {
+                price[i] += (step(rng) - 100) / 100.0 * vol[market.risk(i)] * price[i];
+                if (price[i] < 1) price[i] = 1;
+            }
+        double value = 0, budget = config.initialBalance / n;
+        for (size_t i = 0; i < n; ++i) value += budget / market.price(i) * price[i];
+        return value;
+    }
+
+public:
+    explicit SweepRunner(const MarketDefinition& market) : market(market) {}
+
+    vector<SweepSummary> run(const vector<SimulationConfig>& configs, size_t threads = 0) const {
+        vector<vector<double>> finals(configs.size());
+        WorkStealingPool pool(threads);
+        for (size_t c = 0; c < configs.size(); ++c) {
+            finals[c].resize(configs[c].paths);
+            for (size_t begin = 0; begin < configs[c].paths; begin += pathsPerTask) {
+                size_t end = min(begin + pathsPerTask, configs[c].paths);
+                pool.submit([this, &configs, &finals, c, begin, end] {
+                    for (size_t p = begin; p < end; ++p) finals[c][p] = simulatePath(configs[c], p);
+                });
+            }
+        }
+        pool.run();
+
+        vector<SweepSummary> summaries(configs.size());
+        for (size_t c = 0; c < configs.size(); ++c) {
+            SweepSummary& s = summaries[c];
+            s.config = configs[c];
+            const vector<double>& v = finals[c];
+            if (v.empty() || market.size() == 0) continue;
+            s.min = s.max = v[0];
+            for (double x : v) { s.mean += x; s.min = min(s.min, x); s.max = max(s.max, x); }
+            s.mean /= v.size();
+            for (double x : v) s.stddev += (x - s.mean) * (x - s.mean);
+            s.stddev = v.size() > 1 ? sqrt(s.stddev / (v.size() - 1)) : 0.0;
+            s.meanReturn = s.mean / configs[c].initialBalance - 1;
+        }
+        return summaries;
+    }
+};
+
+class ReplayFeed { // Advances the market day by day from a memory-mapped file of recorded prices
+private:
+    static constexpr char magic[4] = {'S', 'S', 'P', 'H'};
+    static constexpr size_t prefetchDays = 256; // Days requested from the kernel ahead of the reader
+
+    struct Header { // Followed by days x instruments doubles, day-major
+        char magic[4];
+        uint32_t version;
+        uint64_t days;
+        uint64_t instruments;
+    };
+
+    string path; // For error messages
+    MappedFile file;
+    Header header;
+    size_t nextDay = 0; // Next day to replay
+    size_t prefetchedUntil = 0; // Days already advised to the kernel
+
+    const double* dayData(size_t d) const { return (const double*)(file.data() + sizeof(Header)) + d * header.instruments; }
+
+    void prefetch(size_t day) { // Ask the kernel to read the next block before it is needed
+        if (day < prefetchedUntil) return;
+        size_t rowBytes = header.instruments * sizeof(double);
+        size_t end = min(day + prefetchDays, (size_t)header.days);
+        file.advise(sizeof(Header) + day * rowBytes, (end - day) * rowBytes, MADV_WILLNEED);
+        prefetchedUntil = end;
+    }
+
+public:
+    explicit ReplayFeed(const string& path) : path(path), file(path) {
+        if (file.size() < sizeof header) throw runtime_error(path + ": truncated header");
+        memcpy(&header, file.data(), sizeof header);
+        if (memcmp(header.magic, magic, 4) != 0 || header.version != 1) throw runtime_error(path + ": not a price history file");
+        size_t room = (file.size() - sizeof header) / sizeof(double); // Prices the file holds, both counts are bounded by it before multiplying
+        if (header.instruments > room || (header.instruments && header.days > room / header.instruments))
+            throw runtime_error(path + ": truncated data");
+        file.advise(0, file.size(), MADV_SEQUENTIAL);
+        prefetch(0);
+    }
+
+    static void record(const PriceTable& prices, const string& path) { // Write prices in the replay format
+        ofstream out(path, ios::binary);
+        if (!out) throw runtime_error("cannot write " + path);
+        Header h;
+        memcpy(h.magic, magic, 4);
+        h.version = 1;
+        h.days = prices.dayCount();
+        h.instruments = prices.instrumentCount();
+        out.write((const char*)&h, sizeof h);
+        if (h.days) out.write((const char*)prices.day(0), h.days * h.instruments * sizeof(double));
+    }
+
+    bool finished() const { return nextDay >= header.days; }
+    size_t dayCount() const { return header.days; }
+    size_t instrumentCount() const { return header.instruments; }
+    size_t currentDay() const { return nextDay; }
+
+    PriceTable table() const { return PriceTable(dayData(0), header.days, header.instruments); } // Zero-copy view for backtests
+
+    const double* advance() { // Prices of the next day indexed by stock ID - 1, nullptr once finished
+        if (finished()) return nullptr;
+        if (prefetchedUntil < header.days && nextDay + prefetchDays / 2 >= prefetchedUntil) prefetch(prefetchedUntil); // Next block once within half a block of the advised end
+        const double* row = dayData(nextDay++);
+        if (!finished()) __builtin_prefetch(dayData(nextDay)); // Warm the first line of the next day
+        return row;
+    }
+
+    bool advance(const vector<SimulatedStock*>& market) { // Move every stock to its next recorded price, throws on a day with a bad price
+        const double* row = advance();
+        if (!row) return false;
+        size_t count = min(market.size(), (size_t)header.instruments);
+        for (size_t i = 0; i < count; ++i) // Checked before any stock moves, returns and indicators divide by prices
+            if (!(row[i] > 0) || !isfinite(row[i]))
+                throw runtime_error(path + ": day " + to_string(nextDay) + " has an invalid price for stock " + to_string(i + 1));
+        for (size_t i = 0; i < count; ++i) market[i]->recordPrice(row[i]);
+        return true;
+    }
+};
+
+struct Bar { // OHLCV bar in compact form
+    float open, high, low, close;
+    uint32_t volume;
+};
+
+class IntradayBook { // Generates intraday ticks and aggregates them into bars, keeping the last few days of bars instead of raw ticks
+public:
+    static constexpr uint32_t sessionSeconds = 6 * 3600 + 1800; // 9:30 to 16:00
+
+private:
+    size_t count; // Number of instruments
+    size_t ticksPerDay; // Ticks per instrument per day
+    size_t keepDays; // Days of bars kept, older days are overwritten
+    uint64_t day = 0; // Sessions started so far
+    vector<uint32_t> resolutions; // Bar lengths in seconds, a full session gives daily bars
+    vector<size_t> bucketsPerDay; // Per resolution
+    vector<vector<Bar>> bars; // Per resolution, a ring of keepDays days: bars[r][(slot * bucketsPerDay[r] + bucket) * count + i]
+    vector<float> carry; // Previous close per instrument, fills buckets without ticks
+    mt19937_64 rng;
+
+    size_t slot(size_t daysAgo) const { return (day - 1 - daysAgo) % keepDays; }
+    Bar& at(size_t r, size_t daysAgo, size_t bucket, size_t i) { return bars[r][(slot(daysAgo) * bucketsPerDay[r] + bucket) * count + i]; }
+
+public:
+    IntradayBook(size_t count, size_t ticksPerDay = 390, vector<uint32_t> wanted = {60, 300, 1800, sessionSeconds},
+                 size_t keepDays = 5, unsigned seed = random_device{}())
+        : count(count), ticksPerDay(ticksPerDay ? ticksPerDay : 1), keepDays(keepDays ? keepDays : 1), carry(count), rng(seed) {
+        double interval = (double)sessionSeconds / this->ticksPerDay;
+        for (uint32_t r : wanted) { // A bar no longer than the tick interval holds one tick and costs more than the tick itself
+            if (r == 0 || (r < sessionSeconds && r <= interval)) continue;
+            resolutions.push_back(r);
+            bucketsPerDay.push_back((sessionSeconds + r - 1) / r);
+            bars.emplace_back(this->keepDays * bucketsPerDay.back() * count);
+        }
+    }
+
+    void beginDay(const vector<double>& previousClose) { // Clears the oldest day's bars for the new session
+        ++day;
+        for (size_t i = 0; i < count; ++i) carry[i] = (float)previousClose[i];
+        for (size_t r = 0; r < resolutions.size(); ++r)
+            fill_n(bars[r].begin() + slot(0) * bucketsPerDay[r] * count, bucketsPerDay[r] * count, Bar{});
+    }
+
+    void addTick(size_t i, uint32_t second, double price, uint32_t volume) { // Fold one positive-price tick into today's bar of each resolution
+        for (size_t r = 0; r < resolutions.size(); ++r) {
+            Bar& bar = at(r, 0, min<size_t>(second / resolutions[r], bucketsPerDay[r] - 1), i);
+            float p = (float)price;
+            if (bar.open == 0) { bar = {p, p, p, p, volume}; continue; } // Untouched bars still hold open 0
+            if (p > bar.high) bar.high = p;
+            if (p < bar.low) bar.low = p;
+            bar.close = p;
+            bar.volume += volume;
+        }
+    }
+
+    void endDay() { // Buckets without ticks repeat the previous close
+        for (size_t r = 0; r < resolutions.size(); ++r)
+            for (size_t i = 0; i < count; ++i) {
+                float last = carry[i];
+                for (size_t b = 0; b < bucketsPerDay[r]; ++b) {
+                    Bar& bar = at(r, 0, b, i);
+                    if (bar.open == 0) bar = {last, last, last, last, 0};
+                    else last = bar.close;
+                }
+            }
+    }
+
+    void simulateDay(const vector<SimulatedStock*>& market) { // One session of ticks, the close is recorded as the day's price
+        vector<double> closes(count);
+        for (size_t i = 0; i < count && i < market.size(); ++i) closes[i] = market[i]->getPrice();
+        beginDay(closes);
+        uniform_real_distribution<double> unit(-1.0, 1.0);
+        uniform_int_distribution<uint32_t> lots(1, 100);
+        double scale = sqrt(3.0 / ticksPerDay); // Per-tick move so a day keeps the daily volatility
+        for (size_t i = 0; i < count && i < market.size(); ++i) {
+            double price = closes[i];
+            double vol = market[i]->volatility() / sqrt(3.0) * scale;
+            for (size_t t = 0; t < ticksPerDay; ++t) {
+                price *= 1 + vol * unit(rng);
+                if (price < 1) price = 1;
+                addTick(i, (uint32_t)(t * (uint64_t)sessionSeconds / ticksPerDay), price, lots(rng) * 100);
+            }
+            market[i]->recordPrice(price); // Only the close goes into priceHistory
+        }
+        endDay();
+    }
+
+    size_t resolutionCount() const { return resolutions.size(); }
+    uint32_t resolution(size_t r) const { return resolutions[r]; }
+    size_t bucketCount(size_t r) const { return bucketsPerDay[r]; } // Bars per instrument per day
+    size_t daysKept() const { return day < keepDays ? day : keepDays; }
+    const Bar& bar(size_t r, size_t daysAgo, size_t bucket, size_t instrument) const { // daysAgo below daysKept(), 0 is the latest session
+        return bars[r][(slot(daysAgo) * bucketsPerDay[r] + bucket) * count + instrument];
+    }
+};
+
+struct SimEvent { // Something that happens to an instrument at a simulation time
+    enum Kind : uint8_t { Tick, OrderArrival, Dividend, Split } kind;
+    uint32_t instrument; // Index of the instrument, stock ID - 1
+    uint64_t time; // Simulation time in microseconds
+    int32_t quantity; // Order size, positive buys and negative sells
+    double amount; // Dividend per share, or new shares per old share for a split
+};
+
+class EventScheduler { // Monotone radix heap of events keyed by simulation time
+private:
+    vector<SimEvent> buckets[65]; // Bucket k holds keys whose highest bit differing from `last` is k - 1
+    uint64_t last = 0; // Time of the most recently extracted event, never decreases
+    size_t count = 0;
+
+    static int bucketOf(uint64_t time, uint64_t last) { return time == last ? 0 : 64 - __builtin_clzll(time ^ last); }
+
+    void refill() { // Move the smallest non-empty bucket down so bucket 0 holds the next events
+        if (!buckets[0].empty()) return;
+        int k = 1;
+        while (buckets[k].empty()) ++k;
+        uint64_t smallest = UINT64_MAX;
+        for (const auto& e : buckets[k]) smallest = min(smallest, e.time);
+        last = smallest;
+        for (const auto& e : buckets[k]) buckets[bucketOf(e.time, last)].push_back(e); // Always lands below k
+        buckets[k].clear();
+    }
+
+public:
+    void schedule(SimEvent event) { // Events in the past run at the current time
+        if (event.time < last) event.time = last;
+        buckets[bucketOf(event.time, last)].push_back(event);
+        ++count;
+    }
+
+    bool empty() const { return count == 0; }
+    size_t size() const { return count; }
+    uint64_t now() const { return last; }
+
+    uint64_t nextTime() { // Time of the earliest pending event, the queue must not be empty
+        refill();
+        return last;
+    }
+
+    SimEvent pop() { // Earliest event, ties in no particular order
+        refill();
+        SimEvent e = buckets[0].back();
+        buckets[0].pop_back();
+        --count;
+        return e;
+    }
+
+    template <typename Handler>
+    size_t run(uint64_t until, Handler&& handler) { // Process events up to `until`, handlers may schedule more
+        size_t processed = 0;
+        while (!empty() && nextTime() <= until) {
+            handler(pop(), *this);
+            ++processed;
+        }
+        return processed;
+    }
+};
+
+struct EventFill { // Outcome of an order arrival, priced at the market when it arrived
+    uint32_t instrument; // Stock ID - 1
+    int32_t quantity; // Positive bought, negative sold
+    double price;
+    TradeStatus status;
+};
+
+class EventDrivenMarket { // Drives ticks, orders, dividends and splits of a market from one event queue
+private:
+    const vector<SimulatedStock*>& market;
+    UserPortfolio& portfolio; // Account that receives orders and dividends
+    vector<uint64_t> tickInterval; // Per instrument, in microseconds
+    EventScheduler scheduler;
+    uint64_t sessionEnd = 0; // Close of the last session run by runDay()
+    bool started = false; // First ticks are scheduled when the market first runs, after any setTickInterval()
+    vector<EventFill> fills; // Orders processed since the last takeFills()
+    function<void(size_t, double, double)> onCorporateAction; // Instrument, price factor and split ratio (0 for a dividend), keeps outside analytics continuous
+
+    void handle(const SimEvent& e, EventScheduler& queue) {
+        if (e.instrument >= market.size()) return;
+        SimulatedStock* stock = market[e.instrument];
+        switch (e.kind) {
+            case SimEvent::Tick: { // Move the price, scaled so a session keeps the daily volatility
+                double scale = sqrt((double)tickInterval[e.instrument] / sessionMicros);
+                stock->applyReturn(((rand() % 201) - 100) / 100.0 * stock->volatility() * scale);
+                queue.schedule({SimEvent::Tick, e.instrument, e.time + tickInterval[e.instrument], 0, 0.0});
+                break;
+            }
+            case SimEvent::OrderArrival: {
+                double price = stock->getPrice();
+                if (e.quantity > 0) fills.push_back({e.instrument, e.quantity, price, portfolio.applyBuy(stock, e.quantity, price)});
+                else if (e.quantity < 0) fills.push_back({e.instrument, e.quantity, price, portfolio.applySell(stock->getId(), -e.quantity, price)});
+                break;
+            }
+            case SimEvent::Dividend: {
+                double before = stock->getPrice();
+                stock->applyDividend(e.amount);
+                portfolio.applyDividend(stock->getId(), e.amount);
+                if (onCorporateAction) onCorporateAction(e.instrument, stock->getPrice() / before, 0.0);
+                break;
+            }
+            case SimEvent::Split:
+                if (e.amount <= 0) break;
+                stock->applySplit(e.amount);
+                portfolio.applySplit(stock->getId(), e.amount, stock->getPrice());
+                if (onCorporateAction) onCorporateAction(e.instrument, 1.0 / e.amount, e.amount);
+                break;
+        }
+    }
+
+public:
+    static constexpr uint64_t sessionMicros = (6 * 3600 + 1800) * 1000000ull; // One trading day
+
+    EventDrivenMarket(const vector<SimulatedStock*>& market, UserPortfolio& portfolio)
+        : market(market), portfolio(portfolio), tickInterval(market.size()) {
+        for (size_t i = 0; i < market.size(); ++i) { // Riskier stocks update more often
+            uint8_t risk = VolatilityProfile::riskIndex(market[i]->getRiskLevel());
+            tickInterval[i] = risk == 2 ? sessionMicros / 13 : risk == 1 ? sessionMicros / 6 : sessionMicros;
+        }
+    }
+
+    void setTickInterval(size_t instrument, uint64_t micros) { tickInterval[instrument] = micros ? micros : 1; } // From the instrument's next tick on
+    void setCorporateActionHandler(function<void(size_t, double, double)> handler) { onCorporateAction = move(handler); }
+    void schedule(const SimEvent& e) { scheduler.schedule(e); }
+    uint64_t now() const { return scheduler.now(); }
+    uint64_t nextOpen() const { return sessionEnd; } // Start of the session the next runDay() simulates
+
+    size_t runUntil(uint64_t time) { // Returns the number of processed events
+        if (!started) {
+            for (size_t i = 0; i < market.size(); ++i) scheduler.schedule({SimEvent::Tick, (uint32_t)i, now() + tickInterval[i], 0, 0.0});
+            started = true;
+        }
+        return scheduler.run(time, [this](const SimEvent& e, EventScheduler& queue) { handle(e, queue); });
+    }
+
+    size_t runDay() { // Up to the next session close
+        sessionEnd += sessionMicros;
+        return runUntil(sessionEnd);
+    }
+
+    vector<EventFill> takeFills() {
+        vector<EventFill> out;
+        out.swap(fills);
+        return out;
+    }
+};
+
+namespace Wire { // Binary trading protocol, fixed-size frames in host byte order
+    enum Op : uint8_t { Quote = 1, Buy = 2, Sell = 3, Balance = 4 };
+    enum Status : uint8_t { Ok = 0, InsufficientBalance = 1, InsufficientQuantity = 2, NotFound = 3, BadRequest = 4 };
+
+    struct Request { // 16 bytes
+        uint8_t op;
+        uint8_t reserved[3];
+        uint32_t account; // Index of the account
+        uint32_t stockId; // Stock ID, unused by Balance
+        int32_t quantity; // Shares to trade, unused by Quote and Balance
+    };
+
+    struct Response { // 24 bytes
+        uint8_t status;
+        uint8_t op; // Echo of the request
+        uint8_t reserved[2];
+        uint32_t stockId;
+        int64_t price; // Price in 1e-4 ticks after the request
+        int64_t balance; // Account balance in 1e-4 ticks after the request
+    };
+
+    static_assert(sizeof(Request) == 16 && sizeof(Response) == 24, "wire frames must stay packed");
+
+    inline uint8_t fromTradeStatus(TradeStatus status) {
+        switch (status) {
+            case TradeStatus::Ok: return Ok;
+            case TradeStatus::InsufficientBalance: return InsufficientBalance;
+            case TradeStatus::InsufficientQuantity: return InsufficientQuantity;
+            default: return NotFound;
+        }
+    }
+
+    inline Response execute(const Request& r, const vector<SimulatedStock*>& market, vector<unique_ptr<UserPortfolio>>& accounts) {
+        Response resp{};
+        resp.op = r.op;
+        resp.stockId = r.stockId;
+        if (r.account >= accounts.size()) { resp.status = BadRequest; return resp; }
+        UserPortfolio& account = *accounts[r.account];
+        SimulatedStock* stock = (r.stockId >= 1 && r.stockId <= market.size()) ? market[r.stockId - 1] : nullptr;
+        switch (r.op) {
+            case Quote:
+                resp.status = stock ? Ok : NotFound;
+                break;
+            case Buy:
+                if (!stock || r.quantity <= 0) resp.status = stock ? BadRequest : NotFound;
+                else resp.status = fromTradeStatus(account.applyBuy(stock, r.quantity, stock->getPrice()));
+                break;
+            case Sell:
+                if (!stock || r.quantity <= 0) resp.status = stock ? BadRequest : NotFound;
+                else resp.status = fromTradeStatus(account.applySell(stock->getId(), r.quantity, stock->getPrice()));
+                break;
+            case Balance:
+                resp.status = Ok;
+                break;
+            default:
+                resp.status = BadRequest;
+        }
+        if (stock) resp.price = Price::fromDouble(stock->getPrice()).getTicks();
+        resp.balance = account.getCash().getTicks();
+        return resp;
+    }
+
+    inline int listenOn(int fd, const sockaddr* address, socklen_t length) { // Non-blocking listening socket
+        if (fd < 0 || bind(fd, address, length) != 0 || listen(fd, SOMAXCONN) != 0) {
+            if (fd >= 0) ::close(fd);
+            throw runtime_error(string("cannot listen: ") + strerror(errno));
+        }
+        return fd;
+    }
+
+    inline int listenUnix(const string& path) {
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        if (path.size() >= sizeof address.sun_path) throw runtime_error("socket path too long");
+        strcpy(address.sun_path, path.c_str());
+        unlink(path.c_str()); // Replace a stale socket from an earlier run
+        return listenOn(socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0), (sockaddr*)&address, sizeof address);
+    }
+
+    inline int listenTcp(uint16_t port) { // Loopback only
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(port);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        return listenOn(fd, (sockaddr*)&address, sizeof address);
+    }
+}
+
+class TradingServer { // Single-threaded epoll loop serving quotes and trades to many clients
+private:
+    static constexpr size_t inputLimit = 1 << 18; // Bytes read per wake-up, level-triggered epoll reports the rest again
+    static constexpr size_t outputLimit = 1 << 20; // Queued response bytes before a client stops being read
+
+    struct Connection {
+        int fd;
+        string in; // Received bytes not yet parsed
+        string out; // Responses not yet written
+        uint32_t events = EPOLLIN | EPOLLRDHUP; // Registered interest
+    };
+
+    const vector<SimulatedStock*>& market;
+    vector<unique_ptr<UserPortfolio>> accounts; // Shared by every client
+    int epollFd = -1, listenFd = -1, timerFd = -1;
+    string unixPath; // Removed on shutdown
+    unordered_map<int, Connection> connections;
+    atomic<bool> running{false};
+    uint64_t served = 0;
+
+    Wire::Response handle(const Wire::Request& r) {
+        ++served;
+        return Wire::execute(r, market, accounts);
+    }
+
+    void watch(int fd, uint32_t events, int op) {
+        epoll_event ev{};
+        ev.events = events;
+        ev.data.fd = fd;
+        epoll_ctl(epollFd, op, fd, &ev);
+    }
+
+    void close(Connection& c) {
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, c.fd, nullptr);
+        ::close(c.fd);
+        connections.erase(c.fd);
+    }
+
+    void accept() {
+        while (true) {
+            int fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) return; // EAGAIN once the backlog is drained
+            connections[fd] = Connection{fd, {}, {}};
+            watch(fd, EPOLLIN | EPOLLRDHUP, EPOLL_CTL_ADD);
+        }
+    }
+
+    bool flush(Connection& c) { // Write pending responses, false if the peer is gone
+        size_t written = 0;
+        while (written < c.out.size()) {
+            ssize_t n = ::send(c.fd, c.out.data() + written, c.out.size() - written, MSG_NOSIGNAL);
+            if (n > 0) { written += n; continue; }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            return false;
+        }
+        c.out.erase(0, written);
+        rearm(c);
+        return true;
+    }
+
+    void rearm(Connection& c) { // Read only while the backlog is under the cap, ask for EPOLLOUT only while responses are queued
+        uint32_t events = EPOLLRDHUP | (c.out.size() < outputLimit ? (uint32_t)EPOLLIN : 0u) | (c.out.empty() ? 0u : (uint32_t)EPOLLOUT);
+        if (events == c.events) return;
+        c.events = events;
+        watch(c.fd, events, EPOLL_CTL_MOD);
+    }
+
+    bool receive(Connection& c) { // Read everything available and answer every complete frame
+        char buffer[65536];
+        while (c.in.size() < inputLimit) { // Bounded so one pipelining client can't grow the buffers without limit
+            ssize_t n = ::recv(c.fd, buffer, sizeof buffer, 0);
+            if (n > 0) { c.in.append(buffer, n); continue; }
+            if (n == 0) return false;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return false;
+        }
+        size_t frames = c.in.size() / sizeof(Wire::Request);
+        size_t base = c.out.size();
+        c.out.resize(base + frames * sizeof(Wire::Response));
+        for (size_t i = 0; i < frames; ++i) { // Whole batch answered before a single write
+            Wire::Request request;
+            memcpy(&request, c.in.data() + i * sizeof request, sizeof request);
+            Wire::Response response = handle(request);
+            memcpy(&c.out[base + i * sizeof response], &response, sizeof response);
+        }
+        c.in.erase(0, frames * sizeof(Wire::Request));
+        return flush(c);
+    }
+
+public:
+    TradingServer(const vector<SimulatedStock*>& market, size_t accountCount, double initialBalance = 3000.0) : market(market) {
+        for (size_t i = 0; i < accountCount; ++i) accounts.push_back(make_unique<UserPortfolio>(initialBalance));
+        epollFd = epoll_create1(EPOLL_CLOEXEC);
+        if (epollFd < 0) throw runtime_error("epoll_create1 failed");
+    }
+
+    ~TradingServer() {
+        for (auto& entry : connections) ::close(entry.first);
+        if (listenFd >= 0) ::close(listenFd);
+        if (timerFd >= 0) ::close(timerFd);
+        if (epollFd >= 0) ::close(epollFd);
+        if (!unixPath.empty()) unlink(unixPath.c_str());
+    }
+
+    void listenUnix(const string& path) {
+        listenFd = Wire::listenUnix(path);
+        unixPath = path;
+    }
+
+    void listenTcp(uint16_t port) { listenFd = Wire::listenTcp(port); } // Loopback only
+
+    void tickEvery(unsigned milliseconds) { // Move every market price on a timer
+        timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        itimerspec spec{};
+        spec.it_interval.tv_sec = spec.it_value.tv_sec = milliseconds / 1000;
+        spec.it_interval.tv_nsec = spec.it_value.tv_nsec = (milliseconds % 1000) * 1000000L;
+        timerfd_settime(timerFd, 0, &spec, nullptr);
+        watch(timerFd, EPOLLIN, EPOLL_CTL_ADD);
+    }
+
+    void run() { // Serve until stop() is called
+        watch(listenFd, EPOLLIN, EPOLL_CTL_ADD);
+        running = true;
+        epoll_event events[256];
+        while (running.load(memory_order_relaxed)) {
+            int ready = epoll_wait(epollFd, events, 256, 100); // Wake up regularly to notice stop()
+            for (int i = 0; i < ready; ++i) {
+                int fd = events[i].data.fd;
+                if (fd == listenFd) { accept(); continue; }
+                if (fd == timerFd) {
+                    uint64_t expirations;
+                    if (read(timerFd, &expirations, sizeof expirations) > 0)
+                        for (auto s : market) s->updatePrice();
+                    continue;
+                }
+                auto it = connections.find(fd);
+                if (it == connections.end()) continue;
+                Connection& c = it->second;
+                bool alive = !(events[i].events & (EPOLLERR | EPOLLHUP));
+                if (alive && (events[i].events & EPOLLIN)) alive = receive(c);
+                if (alive && (events[i].events & EPOLLOUT)) alive = flush(c);
+                if (alive && (events[i].events & EPOLLRDHUP) && c.out.empty()) alive = false;
+                if (!alive) close(c);
+            }
+        }
+    }
+
+    void stop() { running = false; } // Safe from any thread or a signal handler
+    uint64_t requestsServed() const { return served; }
+    UserPortfolio& account(size_t i) { return *accounts[i]; }
+};
+
+struct SessionTask { // Fire-and-forget coroutine, the frame frees itself when the body returns
+    struct promise_type {
+        SessionTask get_return_object() noexcept { return {}; }
+        suspend_never initial_suspend() noexcept { return {}; } // Runs eagerly up to the first co_await
+        suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept { terminate(); }
+    };
+};
+
+class Reactor { // One edge-triggered epoll loop per thread, resuming the coroutines that wait on its sockets
+private:
+    struct Waiters {
+        coroutine_handle<> reader, writer;
+        bool readable = false, writable = false; // Edge seen while nobody was waiting
+    };
+
+    int epollFd = -1, wakeFd = -1;
+    unordered_map<int, Waiters> sockets; // Touched by the reactor thread only once started
+    mutex postLock;
+    vector<coroutine_handle<>> resumes; // Posted from other threads
+    vector<int> adopted; // Sockets handed over by another reactor
+    function<void(Reactor&, int)> onAdopt; // Starts a session for an adopted socket
+    atomic<bool> running{false};
+    thread worker;
+
+    void wake() {
+        uint64_t one = 1;
+        if (write(wakeFd, &one, sizeof one) < 0) {} // Counter overflow is impossible, a full counter still wakes
+    }
+
+    void drain() { // Run work posted by other threads
+        uint64_t value;
+        if (read(wakeFd, &value, sizeof value) < 0) {}
+        vector<coroutine_handle<>> ready;
+        vector<int> incoming;
+        {
+            lock_guard<mutex> guard(postLock);
+            ready.swap(resumes);
+            incoming.swap(adopted);
+        }
+        for (int fd : incoming) {
+            add(fd);
+            onAdopt(*this, fd);
+        }
+        for (auto h : ready) h.resume();
+    }
+
+    void loop() {
+        epoll_event events[256];
+        while (running.load(memory_order_relaxed)) {
+            int count = epoll_wait(epollFd, events, 256, -1);
+            for (int i = 0; i < count; ++i) {
+                int fd = events[i].data.fd;
+                if (fd == wakeFd) { drain(); continue; }
+                auto it = sockets.find(fd);
+                if (it == sockets.end()) continue;
+                Waiters& w = it->second;
+                uint32_t e = events[i].events;
+                if (e & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) w.readable = true;
+                if (e & (EPOLLOUT | EPOLLHUP | EPOLLERR)) w.writable = true;
+                coroutine_handle<> reader, writer; // Taken out first, a resumed session may close the socket
+                if (w.readable && w.reader) { w.readable = false; reader = exchange(w.reader, nullptr); }
+                if (w.writable && w.writer) { w.writable = false; writer = exchange(w.writer, nullptr); }
+                if (reader) reader.resume();
+                if (writer) writer.resume();
+            }
+        }
+    }
+
+public:
+    struct Readiness { // co_await until the socket is readable or writable again
+        Reactor& reactor;
+        int fd;
+        bool write;
+
+        bool await_ready() noexcept { // Consume an edge that arrived while the session was busy
+            Waiters& w = reactor.sockets[fd];
+            bool& edge = write ? w.writable : w.readable;
+            return exchange(edge, false);
+        }
+        void await_suspend(coroutine_handle<> h) noexcept {
+            Waiters& w = reactor.sockets[fd];
+            (write ? w.writer : w.reader) = h;
+        }
+        void await_resume() const noexcept {}
+    };
+
+    explicit Reactor(function<void(Reactor&, int)> onAdopt) : onAdopt(move(onAdopt)) {
+        epollFd = epoll_create1(EPOLL_CLOEXEC);
+        wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (epollFd < 0 || wakeFd < 0) throw runtime_error("cannot create reactor");
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.fd = wakeFd;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &ev);
+    }
+
+    ~Reactor() { // Sessions still suspended here are destroyed with their sockets
+        stop();
+        for (auto& entry : sockets) {
+            if (entry.second.reader) entry.second.reader.destroy();
+            if (entry.second.writer) entry.second.writer.destroy();
+            ::close(entry.first);
+        }
+        for (auto h : resumes) h.destroy();
+        for (int fd : adopted) ::close(fd);
+        ::close(wakeFd);
+        ::close(epollFd);
+    }
+
+    Reactor(const Reactor&) = delete;
+    Reactor& operator=(const Reactor&) = delete;
+
+    void add(int fd) { // Register once for both directions, the reactor owns the socket from here on
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.fd = fd;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev);
+        sockets[fd] = Waiters{};
+    }
+
+    void close(int fd) {
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+        sockets.erase(fd);
+        ::close(fd);
+    }
+
+    Readiness readable(int fd) { return {*this, fd, false}; }
+    Readiness writable(int fd) { return {*this, fd, true}; }
+
+    void post(coroutine_handle<> h) { // Resume h on this reactor's thread, callable from any thread
+        bool idle;
+        {
+            lock_guard<mutex> guard(postLock);
+            idle = resumes.empty() && adopted.empty(); // Otherwise a wake-up is already pending
+            resumes.push_back(h);
+        }
+        if (idle) wake();
+    }
+
+    void adopt(int fd) { // Hand an accepted socket to this reactor
+        bool idle;
+        {
+            lock_guard<mutex> guard(postLock);
+            idle = resumes.empty() && adopted.empty();
+            adopted.push_back(fd);
+        }
+        if (idle) wake();
+    }
+
+    void start() {
+        running = true;
+        worker = thread([this] { loop(); });
+    }
+
+    void stop() {
+        if (!worker.joinable()) return;
+        running = false;
+        wake();
+        worker.join();
+    }
+};
+
+class OrderDesk { // The one thread that touches accounts and prices, executing batches from every session in arrival order
+private:
+    struct Batch {
+        Reactor* reactor; // Where the session resumes
+        coroutine_handle<> session;
+        const Wire::Request* requests;
+        size_t count;
+        Wire::Response* responses;
+    };
+
+    const vector<SimulatedStock*>& market;
+    vector<unique_ptr<UserPortfolio>> accounts;
+    mutex lock;
+    condition_variable ready;
+    vector<Batch> queue;
+    bool running = false; // Guarded by lock
+    chrono::milliseconds tickInterval{1000};
+    atomic<uint64_t> served{0};
+    thread worker;
+
+    void enqueue(const Batch& batch) {
+        {
+            lock_guard<mutex> guard(lock);
+            queue.push_back(batch);
+        }
+        ready.notify_one();
+    }
+
+    void loop() {
+        vector<Batch> work;
+        auto nextTick = chrono::steady_clock::now() + tickInterval;
+        unique_lock<mutex> guard(lock);
+        while (running) {
+            ready.wait_until(guard, nextTick, [&] { return !queue.empty() || !running; });
+            work.swap(queue);
+            guard.unlock();
+            for (const Batch& b : work) {
+                for (size_t i = 0; i < b.count; ++i) b.responses[i] = Wire::execute(b.requests[i], market, accounts);
+                served.fetch_add(b.count, memory_order_relaxed);
+                b.reactor->post(b.session);
+            }
+            work.clear();
+            if (chrono::steady_clock::now() >= nextTick) { // Move every market price on schedule
+                for (auto s : market) s->updatePrice();
+                nextTick += tickInterval;
+            }
+            guard.lock();
+        }
+    }
+
+public:
+    struct Acknowledgement { // co_await until the desk has answered every request of the batch
+        OrderDesk& desk;
+        Batch batch;
+
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(coroutine_handle<> h) {
+            batch.session = h;
+            desk.enqueue(batch);
+        }
+        void await_resume() const noexcept {}
+    };
+
+    OrderDesk(const vector<SimulatedStock*>& market, size_t accountCount, double initialBalance) : market(market) {
+        for (size_t i = 0; i < accountCount; ++i) accounts.push_back(make_unique<UserPortfolio>(initialBalance));
+    }
+
+    ~OrderDesk() {
+        stop();
+        for (const Batch& b : queue) b.session.destroy(); // Sessions that never got an answer
+    }
+
+    Acknowledgement execute(Reactor& reactor, const Wire::Request* requests, size_t count, Wire::Response* responses) {
+        return {*this, Batch{&reactor, nullptr, requests, count, responses}};
+    }
+
+    void tickEvery(unsigned milliseconds) { tickInterval = chrono::milliseconds(milliseconds); } // Before start()
+
+    void start() {
+        running = true;
+        worker = thread([this] { loop(); });
+    }
+
+    void stop() {
+        if (!worker.joinable()) return;
+        {
+            lock_guard<mutex> guard(lock);
+            running = false;
+        }
+        ready.notify_one();
+        worker.join();
+    }
+
+    uint64_t requestsServed() const { return served.load(memory_order_relaxed); }
+    UserPortfolio& account(size_t i) { return *accounts[i]; }
+};
+
+class SessionServer { // Same protocol as TradingServer, one coroutine per client spread over a few reactor threads
+private:
+    static constexpr size_t batchFrames = 128; // Requests read per wake-up, keeps a session frame at a few kilobytes
+
+    OrderDesk desk;
+    vector<unique_ptr<Reactor>> reactors;
+    size_t nextReactor = 0;
+    int listenFd = -1, stopFd = -1;
+    string unixPath; // Removed on shutdown
+    atomic<bool> running{false};
+    atomic<uint64_t> accepted{0};
+
+    SessionTask acceptLoop(Reactor& reactor) { // Runs on the first reactor, deals sessions out round-robin
+        while (true) {
+            int fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd >= 0) {
+                accepted.fetch_add(1, memory_order_relaxed);
+                reactors[nextReactor++ % reactors.size()]->adopt(fd);
+            } else if (errno != EINTR && errno != ECONNABORTED) {
+                co_await reactor.readable(listenFd);
+            }
+        }
+    }
+
+    SessionTask session(Reactor& reactor, int fd) { // Read a batch, wait for the desk, write the answers, repeat
+        Wire::Request requests[batchFrames];
+        Wire::Response responses[batchFrames];
+        size_t buffered = 0; // Bytes received, possibly ending in a partial frame
+        bool alive = true;
+        while (alive) {
+            ssize_t n = ::recv(fd, (char*)requests + buffered, sizeof requests - buffered, 0);
+            if (n == 0) break;
+            if (n < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK) break;
+                co_await reactor.readable(fd);
+                continue;
+            }
+            buffered += n;
+            size_t frames = buffered / sizeof(Wire::Request);
+            if (frames == 0) continue;
+            co_await desk.execute(reactor, requests, frames, responses);
+            buffered -= frames * sizeof(Wire::Request);
+            memmove(requests, requests + frames, buffered);
+            size_t total = frames * sizeof(Wire::Response), written = 0;
+            while (written < total) {
+                n = ::send(fd, (const char*)responses + written, total - written, MSG_NOSIGNAL);
+                if (n > 0) written += n;
+                else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) co_await reactor.writable(fd);
+                else { alive = false; break; }
+            }
+        }
+        reactor.close(fd);
+    }
+
+public:
+    SessionServer(const vector<SimulatedStock*>& market, size_t accountCount, size_t reactorCount, double initialBalance = 3000.0)
+        : desk(market, accountCount, initialBalance) {
+        for (size_t i = 0; i < max<size_t>(reactorCount, 1); ++i)
+            reactors.push_back(make_unique<Reactor>([this](Reactor& reactor, int fd) { session(reactor, fd); }));
+        stopFd = eventfd(0, EFD_CLOEXEC);
+        if (stopFd < 0) throw runtime_error("eventfd failed");
+    }
+
+    ~SessionServer() {
+        for (auto& reactor : reactors) reactor->stop();
+        desk.stop();
+        reactors.clear(); // Closes the listening socket and every session socket
+        ::close(stopFd);
+        if (!unixPath.empty()) unlink(unixPath.c_str());
+    }
+
+    void listenUnix(const string& path) {
+        listenFd = Wire::listenUnix(path);
+        unixPath = path;
+        reactors[0]->add(listenFd);
+    }
+
+    void listenTcp(uint16_t port) { // Loopback only
+        listenFd = Wire::listenTcp(port);
+        reactors[0]->add(listenFd);
+    }
+
+    void tickEvery(unsigned milliseconds) { desk.tickEvery(milliseconds); }
+
+    void run() { // Serve on the reactor threads until stop() is called
+        running = true;
+        acceptLoop(*reactors[0]); // Suspends on the listening socket before any reactor thread exists
+        desk.start();
+        for (auto& reactor : reactors) reactor->start();
+        uint64_t value;
+        while (running.load(memory_order_relaxed))
+            if (read(stopFd, &value, sizeof value) < 0 && errno != EINTR) break;
+        for (auto& reactor : reactors) reactor->stop();
+        desk.stop();
+    }
+
+    void stop() { // Safe from any thread or a signal handler
+        running = false;
+        uint64_t one = 1;
+        if (write(stopFd, &one, sizeof one) < 0) {}
+    }
+
+    uint64_t requestsServed() const { return desk.requestsServed(); }
+    uint64_t sessionsAccepted() const { return accepted.load(memory_order_relaxed); }
+    UserPortfolio& account(size_t i) { return desk.account(i); }
+};
+
+class MarketDataPublisher { // Sends per-tick price changes as binary UDP datagrams, with periodic snapshots for late joiners
+public:
+    enum FrameType : uint8_t { Update = 1, Snapshot = 2 };
+
+    struct FrameHeader { // 24 bytes, followed by `count` entries
+        uint32_t magic; // 'SSMF'
+        uint8_t type; // FrameType
+        uint8_t reserved;
+        uint16_t count; // Entries in this datagram
+        uint64_t sequence; // Per datagram, gaps mean lost frames
+        uint64_t tick; // Market tick the prices belong to
+    };
+
+    struct Entry { // 16 bytes
+        uint32_t stockId;
+        uint32_t reserved;
+        int64_t price; // 1e-4 ticks
+    };
+
+    static constexpr uint32_t magic = 0x464D5353; // "SSMF" in little-endian memory order
+    static constexpr size_t maxEntries = (1400 - sizeof(FrameHeader)) / sizeof(Entry); // Stay under a typical MTU
+
+private:
+    int fd = -1;
+    uint64_t sequence = 0;
+    uint64_t snapshotEvery; // Ticks between snapshots
+    vector<int64_t> lastSent; // Last published price per instrument, INT64_MIN before the first
+    vector<char> frame; // Datagram being assembled
+
+    void send(FrameType type, uint64_t tick, const vector<Entry>& entries) { // Split into datagrams
+        for (size_t begin = 0; begin < entries.size() || (begin == 0 && type == Snapshot); begin += maxEntries) {
+            size_t count = min(maxEntries, entries.size() - begin);
+            FrameHeader header{magic, type, 0, (uint16_t)count, ++sequence, tick};
+            frame.resize(sizeof header + count * sizeof(Entry));
+            memcpy(frame.data(), &header, sizeof header);
+            if (count) memcpy(frame.data() + sizeof header, &entries[begin], count * sizeof(Entry));
+            ::send(fd, frame.data(), frame.size(), MSG_DONTWAIT); // Nobody listening is not an error
+            if (count == 0) break;
+        }
+    }
+
+public:
+    MarketDataPublisher(uint16_t port, size_t instruments, uint64_t snapshotEvery = 10)
+        : snapshotEvery(snapshotEvery ? snapshotEvery : 1), lastSent(instruments, INT64_MIN) {
+        fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(port);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (fd < 0 || connect(fd, (sockaddr*)&address, sizeof address) != 0) throw runtime_error("cannot open market data socket");
+    }
+
+    ~MarketDataPublisher() { if (fd >= 0) ::close(fd); }
+
+    MarketDataPublisher(const MarketDataPublisher&) = delete;
+    MarketDataPublisher& operator=(const MarketDataPublisher&) = delete;
+
+    void publish(const vector<double>& prices, uint64_t tick) { // Prices indexed by stock ID - 1, e.g. a PriceBoard snapshot
+        vector<Entry> changed, all;
+        for (size_t i = 0; i < prices.size() && i < lastSent.size(); ++i) {
+            int64_t p = Price::fromDouble(prices[i]).getTicks();
+            Entry e{(uint32_t)(i + 1), 0, p};
+            if (p != lastSent[i]) changed.push_back(e);
+            all.push_back(e);
+            lastSent[i] = p;
+        }
+        if (!changed.empty()) send(Update, tick, changed);
+        if (tick % snapshotEvery == 0) send(Snapshot, tick, all);
+    }
+
+    uint64_t lastSequence() const { return sequence; }
+};
+
+class SharedMarket { // Market prices in a POSIX shared-memory segment, readers map it and never make a syscall per read
+public:
+    struct Header {
+        uint32_t magic; // 'SSHM'
+        uint32_t version;
+        uint64_t count; // Instruments
+        atomic<uint64_t> sequence; // Odd while the writer is updating prices
+        atomic<uint64_t> tick; // Tick of the prices
+    };
+
+    struct Instrument { // 32 bytes of metadata per stock
+        int32_t id;
+        uint8_t risk; // See VolatilityProfile
+        char name[27]; // Truncated, always null-terminated
+    };
+
+    static constexpr uint32_t magic = 0x4D485353; // "SSHM" in little-endian memory order
+    static_assert(atomic<uint64_t>::is_always_lock_free && atomic<double>::is_always_lock_free,
+                  "shared-memory atomics must be lock-free to work across processes");
+
+private:
+    string name; // Segment name, e.g. "/stocksim"
+    bool owner; // Writer side, unlinks the segment on destruction
+    void* base = MAP_FAILED;
+    size_t length = 0;
+    Header* header = nullptr;
+    Instrument* instruments = nullptr;
+    atomic<double>* prices = nullptr;
+
+    static size_t layoutSize(size_t count) { return sizeof(Header) + count * (sizeof(Instrument) + sizeof(double)); }
+
+    void locate(size_t count) {
+        header = (Header*)base;
+        instruments = (Instrument*)((char*)base + sizeof(Header));
+        prices = (atomic<double>*)(instruments + count);
+    }
+
+    SharedMarket(string name, bool owner) : name(move(name)), owner(owner) {}
+
+public:
+    static unique_ptr<SharedMarket> create(const string& name, const vector<SimulatedStock*>& market) { // Writer
+        int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644); // Never adopt, or later unlink, another writer's segment
+        if (fd < 0 && errno == EEXIST)
+            throw runtime_error("shared memory " + name + " already exists, another simulator may be writing it (remove /dev/shm" + name + " if stale)");
+        if (fd < 0) throw runtime_error("cannot create shared memory " + name + ": " + strerror(errno));
+        unique_ptr<SharedMarket> shm(new SharedMarket(name, true)); // Owns the segment from here, unlinks it if mapping fails
+        shm->length = layoutSize(market.size());
+        if (ftruncate(fd, shm->length) == 0) shm->base = mmap(nullptr, shm->length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (shm->base == MAP_FAILED) throw runtime_error("cannot map shared memory " + name);
+        shm->locate(market.size());
+        new (shm->base) Header{magic, 1, market.size(), {0}, {0}};
+        for (size_t i = 0; i < market.size(); ++i) {
+            Instrument& in = shm->instruments[i];
+            in.id = market[i]->getId();
+            in.risk = VolatilityProfile::riskIndex(market[i]->getRiskLevel());
+            snprintf(in.name, sizeof in.name, "%s", market[i]->getName().c_str());
+            new (&shm->prices[i]) atomic<double>(market[i]->getPrice());
+        }
+        return shm;
+    }
+
+    static unique_ptr<SharedMarket> open(const string& name) { // Read-only reader, e.g. in another process
+        unique_ptr<SharedMarket> shm(new SharedMarket(name, false));
+        int fd = shm_open(name.c_str(), O_RDONLY, 0);
+        if (fd < 0) throw runtime_error("cannot open shared memory " + name);
+        struct stat info;
+        if (fstat(fd, &info) == 0 && (size_t)info.st_size >= sizeof(Header)) {
+            shm->length = info.st_size;
+            shm->base = mmap(nullptr, shm->length, PROT_READ, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+        if (shm->base == MAP_FAILED) throw runtime_error("cannot map shared memory " + name);
+        const Header* h = (const Header*)shm->base;
+        if (h->magic != magic || h->version != 1 || layoutSize(h->count) > shm->length) throw runtime_error(name + ": not a market segment");
+        shm->locate(h->count);
+        return shm;
+    }
+
+    ~SharedMarket() {
+        if (base != MAP_FAILED) munmap(base, length);
+        if (owner) shm_unlink(name.c_str());
+    }
+
+    void publish(const vector<double>& current, uint64_t tick) { // Writer only, prices indexed by stock ID - 1
+        uint64_t seq = header->sequence.load(memory_order_relaxed);
+        header->sequence.store(seq + 1, memory_order_relaxed); // Odd: update in progress
+        atomic_thread_fence(memory_order_release);
+        for (size_t i = 0; i < current.size() && i < header->count; ++i) prices[i].store(current[i], memory_order_relaxed);
+        header->tick.store(tick, memory_order_relaxed);
+        header->sequence.store(seq + 2, memory_order_release);
+    }
+
+    uint64_t snapshot(vector<double>& out) const { // Consistent copy of all prices, returns their tick
+        out.resize(header->count);
+        while (true) {
+            uint64_t before = header->sequence.load(memory_order_acquire);
+            if (before & 1) continue; // Writer is mid-update
+            for (size_t i = 0; i < out.size(); ++i) out[i] = prices[i].load(memory_order_relaxed);
+            uint64_t tick = header->tick.load(memory_order_relaxed);
+            atomic_thread_fence(memory_order_acquire);
+            if (header->sequence.load(memory_order_relaxed) == before) return tick;
+        }
+    }
+
+    size_t size() const { return header->count; }
+    const Instrument& instrument(size_t i) const { return instruments[i]; }
+};
+
+template <typename T>
+class SpscQueue { // Bounded lock-free ring buffer for one producer thread and one consumer thread
+private:
+    vector<T> slots; // Ring storage, capacity is a power of two
+    size_t mask; // Capacity - 1, used to wrap indices
+    alignas(64) atomic<size_t> head{0}; // Next slot to read, written only by the consumer
+    alignas(64) atomic<size_t> tail{0}; // Next slot to write, written only by the producer
+
+public:
+    explicit SpscQueue(size_t capacity = 1024) { // Round the capacity up to a power of two
+        size_t size = 2;
+        while (size < capacity) size <<= 1;
+        slots.resize(size);
+        mask = size - 1;
+    }
+
+    bool tryPush(const T& item) { // Producer side, returns false if the queue is full
+        size_t t = tail.load(memory_order_relaxed);
+        if (t - head.load(memory_order_acquire) > mask) return false;
+        slots[t & mask] = item;
+        tail.store(t + 1, memory_order_release); // Publish the item to the consumer
+        return true;
+    }
+
+    bool tryPop(T& item) { // Consumer side, returns false if the queue is empty
+        size_t h = head.load(memory_order_relaxed);
+        if (h == tail.load(memory_order_acquire)) return false;
+        item = slots[h & mask];
+        head.store(h + 1, memory_order_release); // Hand the slot back to the producer
+        return true;
+    }
+};
+
+struct MarketOrder { // Request sent to the shard that owns an instrument
+    enum Kind : uint8_t { Tick, Buy, Sell } kind; // Tick moves every price of the shard, Buy/Sell price a trade
+    uint32_t slot; // Index of the instrument inside its shard
+    int qty; // Quantity to trade
+    int account; // Caller-defined tag routed back with the fill
+};
+
+struct MarketFill { // Trade priced by a shard, to be settled against a portfolio
+    SimulatedStock* stock; // Traded instrument
+    int qty; // Traded quantity
+    double price; // Shard price at the moment the order was processed
+    bool buy; // Side of the trade
+    int account; // Tag copied from the order
+};
+
+class MarketShard { // Group of instruments owned and ticked by one thread
+private:
+    vector<SimulatedStock*> stocks; // Instruments owned by this shard
+    SpscQueue<MarketOrder> inbox; // Orders and ticks from the coordinating thread
+    SpscQueue<MarketFill> outbox; // Fills back to the coordinating thread
+    atomic<uint64_t> processed{0}; // Number of orders fully handled
+    atomic<bool> stopping{false}; // Set when the shard should exit
+    atomic<uint32_t> doorbell{0}; // Bumped after every push and on stop, an idle shard sleeps on it
+    mt19937 rng; // Per-shard random source, rand() is shared by all threads
+    thread worker; // Thread running the shard loop
+
+    void process(const MarketOrder& order) { // Handle one order on the shard thread
+        if (order.kind == MarketOrder::Tick) {
+            STOCKSIM_TRACE("shard tick");
+            uniform_int_distribution<int> step(0, 200); // Same moves as SimulatedStock::updatePrice()
+            for (auto stock : stocks)
+                stock->applyReturn((step(rng) - 100) / 100.0 * stock->volatility());
+            return;
+        }
+        SimulatedStock* stock = stocks[order.slot];
+        MarketFill fill{stock, order.qty, stock->getPrice(), order.kind == MarketOrder::Buy, order.account};
+        while (!outbox.tryPush(fill)) // Wait for the coordinator to make room
+            this_thread::yield();
+    }
+
+    void run() { // Shard loop, drains the inbox until stopped
+        static constexpr int spins = 64; // Empty polls before parking, keeps bursts of orders off the futex
+        MarketOrder order;
+        int idle = 0;
+        while (true) {
+            uint32_t rung = doorbell.load(memory_order_acquire); // Read before the poll so a push in between is not missed
+            if (inbox.tryPop(order)) {
+                process(order);
+                processed.fetch_add(1, memory_order_release); // Publish price changes with the count
+                idle = 0;
+            } else if (stopping.load(memory_order_acquire)) {
+                break;
+            } else if (++idle < spins) {
+                this_thread::yield();
+            } else {
+                doorbell.wait(rung, memory_order_acquire); // Parked until the coordinator rings
+            }
+        }
+    }
+
+    void ring() {
+        doorbell.fetch_add(1, memory_order_release);
+        doorbell.notify_one();
+    }
+
+public:
+    uint64_t submitted = 0; // Orders pushed by the coordinator, touched only by that thread
 
-    virtual ~Stock() {} // Virtual destructor for proper cleanup of derived classes
+    MarketShard(unsigned seed) : inbox(4096), outbox(4096), rng(seed) {}
 
-    virtual void updatePrice() = 0; // Pure virtual function to update stock price, must be implemented by derived classes
+    ~MarketShard() { stop(); }
 
-    string getName() const { return name; } // Getter for stock name
-    double getPrice() const { return currentPrice; } // Getter for current price
-    string getRiskLevel() const { return riskLevel; } // Getter for risk level
-    int getId() const { return id; } // Getter for stock ID
+    size_t add(SimulatedStock* stock) { // Assign an instrument before start(), returns its slot
+        stocks.push_back(stock);
+        return stocks.size() - 1;
+    }
 
-   
-    void setPrice(double price) { currentPrice = price; } // Setter for current price
+    void start() { worker = thread(&MarketShard::run, this); }
 
-    virtual void display() const { // Display stock information
-        cout << setw(2) << id << ". " << setw(12) << name  // Display stock name
-             << " | $" << setw(8) << fixed << setprecision(2) << currentPrice  // Display current price
-             << " | Risk: " << riskLevel; // Display risk level
+    void stop() {
+        stopping.store(true, memory_order_release);
+        ring();
+        if (worker.joinable()) worker.join();
     }
 
-    friend ostream& operator<<(ostream& os, const Stock& stock) { // Overloaded operator to print stock information
-        os << stock.name << " ($" << stock.currentPrice << ", " << stock.riskLevel << ")"; // Output format
-        return os;
+    bool trySubmit(const MarketOrder& order) { // Wakes the shard if it is parked
+        if (!inbox.tryPush(order)) return false;
+        ring();
+        return true;
     }
+    bool tryTakeFill(MarketFill& fill) { return outbox.tryPop(fill); }
+    uint64_t getProcessed() const { return processed.load(memory_order_acquire); }
 };
 
-class SimulatedStock : public Stock { // Derived class for simulated stocks
-protected:
-    vector<double> priceHistory; // Vector to store price history for the stock
+class ShardedMarket { // Market partitioned across shard threads, each owning its prices and order flow
+private:
+    vector<unique_ptr<MarketShard>> shards;
+    unordered_map<int, pair<size_t, uint32_t>> location; // Stock ID -> (shard, slot)
+    vector<MarketFill> fills; // Fills collected from the shards, not yet settled
+
+    void submit(size_t shard, const MarketOrder& order) { // Push an order, collecting fills while the inbox is full
+        while (!shards[shard]->trySubmit(order)) {
+            collectFills();
+            this_thread::yield();
+        }
+        shards[shard]->submitted++;
+    }
+
+    void collectFills() {
+        MarketFill fill;
+        for (auto& shard : shards)
+            while (shard->tryTakeFill(fill)) fills.push_back(fill);
+    }
 
 public:
-    SimulatedStock(int id, std::string name, double price, std::string risk) // Constructor to initialize simulated stock attributes
-        : Stock(id, name, price, risk) { // Call base class constructor
-        priceHistory.push_back(price); // Initialize price history with the current price
+    ShardedMarket(const vector<SimulatedStock*>& market, size_t shardCount) { // Instruments are not owned by the market
+        if (shardCount == 0) shardCount = 1;
+        random_device seeder;
+        for (size_t i = 0; i < shardCount; ++i)
+            shards.push_back(make_unique<MarketShard>(seeder()));
+        for (size_t i = 0; i < market.size(); ++i) { // Round-robin so each shard gets a similar share
+            size_t shard = i % shardCount;
+            location[market[i]->getId()] = {shard, (uint32_t)shards[shard]->add(market[i])};
+        }
+        for (auto& shard : shards) shard->start();
     }
 
-    void updatePrice() override { // Override to update stock price based on risk level
-        double volatility = (riskLevel == "High") ? 0.2 : (riskLevel == "Medium") ? 0.1 : 0.05; // Set volatility based on risk level
-        double change = ((rand() % 201) - 100) / 100.0 * volatility * currentPrice; // Calculate price change based on volatility
-        currentPrice += change; // Update current price with the calculated change
-        if (currentPrice < 1) currentPrice = 1; // Ensure price does not go below 1
-        priceHistory.push_back(currentPrice); // Add new price to history
+    ~ShardedMarket() {
+        for (auto& shard : shards) shard->stop();
     }
 
-    const vector<double>& getHistory() const { return priceHistory; } // Getter for price history
+    size_t shardCount() const { return shards.size(); }
 
-    void display() const override { // Override to display stock information along with price history
-        Stock::display(); // Call base class display method
-        cout << " | Day " << priceHistory.size(); // Display the current day based on price history size
+    void tick() { // Ask every shard to move its prices one day
+        for (size_t i = 0; i < shards.size(); ++i)
+            submit(i, {MarketOrder::Tick, 0, 0, 0});
+    }
+
+    bool submitBuy(int stockId, int qty, int account = 0) { return submitTrade(stockId, qty, account, MarketOrder::Buy); }
+    bool submitSell(int stockId, int qty, int account = 0) { return submitTrade(stockId, qty, account, MarketOrder::Sell); }
+
+    bool submitTrade(int stockId, int qty, int account, MarketOrder::Kind kind) { // Route a trade to the owning shard
+        auto it = location.find(stockId);
+        if (it == location.end()) return false;
+        submit(it->second.first, {kind, it->second.second, qty, account});
+        return true;
+    }
+
+    void wait() { // Block until every submitted order is processed, prices may then be read safely
+        for (auto& shard : shards) {
+            while (shard->getProcessed() < shard->submitted) {
+                collectFills();
+                this_thread::yield();
+            }
+        }
+        collectFills();
+    }
+
+    vector<MarketFill> takeFills() { // Fills gathered so far, in per-shard order
+        collectFills();
+        vector<MarketFill> out;
+        out.swap(fills);
+        return out;
+    }
+
+    static TradeStatus settle(UserPortfolio& user, const MarketFill& fill) { // Apply a fill to a portfolio at its shard price
+        return fill.buy ? user.applyBuy(fill.stock, fill.qty, fill.price)
+                        : user.applySell(fill.stock->getId(), fill.qty, fill.price);
     }
 };
 
-class UserOwnedStock : public SimulatedStock { // Derived class for stocks owned by the user
+class SelfTest { // Checks run by --self-test, each prints PASS or FAIL and any failure fails the run
 private:
-    int quantity;
+    int failures = 0;
 
-public:
-    UserOwnedStock(SimulatedStock* base, int qty) // Constructor to initialize user-owned stock attributes
-        : SimulatedStock(base->getId(), base->getName(), base->getPrice(), base->getRiskLevel()), quantity(qty) {}
+    void check(bool ok, const string& name, const string& detail = "") {
+        if (!ok) ++failures;
+        cout << (ok ? "PASS " : "FAIL ") << name << (detail.empty() ? "" : " (" + detail + ")") << "\n";
+    }
 
-    int getQuantity() const { return quantity; } // Getter for quantity of stocks owned
+    template <typename F>
+    double time(const string& name, F fn) { // Benchmarks only report, timings depend on the machine
+        auto start = chrono::steady_clock::now();
+        fn();
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << "TIME " << name << ": " << fixed << setprecision(3) << seconds << " s\n";
+        return seconds;
+    }
 
-    double getTotalValue() const { return quantity * currentPrice; } // Calculate total value of owned stocks
+    void lots() { // FIFO, LIFO and specific-lot relief, and chunk recycling when positions close
+        SimulatedStock stock(1, "Lots", 100.0, "Low");
+        for (LotRelief order : {LotRelief::Fifo, LotRelief::Lifo}) {
+            UserPortfolio user(100000.0);
+            user.setLotRelief(order);
+            user.applyBuy(&stock, 10, 100.0);
+            user.applyBuy(&stock, 10, 110.0);
+            user.applyBuy(&stock, 10, 120.0);
+            user.applySell(1, 15, 130.0);
+            bool fifo = order == LotRelief::Fifo;
+            string name = fifo ? "lots: FIFO relieves the oldest lots" : "lots: LIFO relieves the newest lots";
+            check(user.getRealizedPnl() == Money::fromDouble(fifo ? 400.0 : 200.0) &&
+                  user.getOwnedStocks()[0]->getCostBasis() == Money::fromDouble(fifo ? 1750.0 : 1550.0), name);
+        }
 
-    void buy(int qty) { quantity += qty; } // Buy more stocks, increasing the quantity owned
-    void sell(int qty) { // Sell stocks, decreasing the quantity owned
-        if (qty <= quantity) quantity -= qty;
-        else cout << "Not enough stock to sell.\n";
+        UserPortfolio user(1000000.0);
+        vector<uint32_t> ids; // One lot per buy, spread over several chunks
+        size_t count = LotPool::lotsPerChunk * 3 + 10;
+        for (size_t i = 0; i < count; ++i) user.applyBuy(&stock, 2, 100.0 + i);
+        user.getOwnedStocks()[0]->forEachLot([&](const TaxLot& lot) { ids.push_back(lot.id); });
+        check(ids.size() == count && user.getLotPool().chunksInUse() == 4, "lots: one lot per buy in 64-lot chunks");
+
+        size_t edges[] = {LotPool::lotsPerChunk - 1, LotPool::lotsPerChunk, 2 * LotPool::lotsPerChunk + 5}; // Both sides of a chunk boundary
+        Money expected;
+        bool sold = true;
+        for (size_t k : edges) {
+            sold &= user.applySellLot(1, ids[k], 2, 300.0) == TradeStatus::Ok;
+            expected += Money::fromDouble(2 * (300.0 - (100.0 + k)));
+        }
+        bool again = user.applySellLot(1, ids[edges[0]], 1, 300.0) == TradeStatus::InsufficientQuantity;
+        check(sold && again && user.getRealizedPnl() == expected, "lots: specific-lot relief across chunk boundaries");
+
+        user.applySell(1, 2 * (LotPool::lotsPerChunk - 1), 300.0); // FIFO up to the hole at the end of the first chunk
+        size_t first = 0;
+        user.getOwnedStocks()[0]->forEachLot([&](const TaxLot& lot) { if (!first) first = lot.id; });
+        check(first == ids[LotPool::lotsPerChunk + 1] && user.getLotPool().chunksInUse() == 3, "lots: emptied lots are trimmed across chunks");
+
+        Money basis;
+        user.getOwnedStocks()[0]->forEachLot([&](const TaxLot& lot) { basis += Price::fromTicks(lot.cost) * lot.quantity; });
+        check(basis == user.getOwnedStocks()[0]->getCostBasis(), "lots: cost basis equals the open lots");
+
+        user.applySell(1, user.getOwnedStocks()[0]->getQuantity(), 300.0);
+        check(user.getOwnedStocks().empty() && user.getLotPool().chunksInUse() == 0, "lots: closing a position frees every chunk");
+
+        size_t allocated = user.getLotPool().chunksAllocated();
+        for (size_t i = 0; i < count; ++i) user.applyBuy(&stock, 1, 100.0);
+        check(user.getLotPool().chunksAllocated() == allocated, "lots: freed chunks are reused");
     }
 
-    void display() const override { // Override to display user-owned stock information
-        SimulatedStock::display();
-        cout << " | Quantity: " << quantity << " | Value: $" << fixed << setprecision(2) << getTotalValue() << "\n"; // Display quantity and total value
+    void pnl() { // The batch P&L of many accounts against a replay of each account's trades through FIFO lots
+        const size_t count = 2000, stocks = 20, trades = 50;
+        mt19937_64 rng(45);
+        vector<SimulatedStock*> market;
+        for (size_t i = 0; i < stocks; ++i) market.push_back(new SimulatedStock((int)i + 1, "P" + to_string(i + 1), 100.0, "Low"));
+        vector<unique_ptr<UserPortfolio>> accounts;
+        vector<PnlReport> expected(count);
+        for (size_t a = 0; a < count; ++a) {
+            accounts.push_back(make_unique<UserPortfolio>(1e6));
+            vector<deque<pair<int, Price>>> lots(stocks); // Open (quantity, price) lots, oldest first
+            for (size_t t = 0; t < trades; ++t) {
+                size_t slot = rng() % stocks;
+                int qty = 1 + rng() % 50;
+                Price price = Price::fromTicks(500000 + rng() % 1500000); // $50 to $200
+                if (rng() % 3) {
+                    accounts[a]->applyBuy(market[slot], qty, price.toDouble());
+                    lots[slot].push_back({qty, price});
+                    continue;
+                }
+                if (accounts[a]->applySell((int)slot + 1, qty, price.toDouble()) != TradeStatus::Ok) continue;
+                for (int left = qty; left > 0;) {
+                    auto& lot = lots[slot].front();
+                    int take = min(left, lot.first);
+                    expected[a].realized += (price - lot.second) * take;
+                    left -= take;
+                    if ((lot.first -= take) == 0) lots[slot].pop_front();
+                }
+            }
+            for (size_t i = 0; i < stocks; ++i)
+                for (const auto& lot : lots[i]) {
+                    expected[a].costBasis += lot.second * lot.first;
+                    expected[a].marketValue += Price::fromDouble(100.0 + i) * lot.first;
+                }
+            expected[a].unrealized = expected[a].marketValue - expected[a].costBasis;
+        }
+        vector<double> prices(stocks);
+        for (size_t i = 0; i < stocks; ++i) prices[i] = 100.0 + i;
+
+        vector<const UserPortfolio*> batch;
+        for (const auto& a : accounts) batch.push_back(a.get());
+        vector<PnlReport> reports;
+        time("pnl: batch of 2000 accounts", [&] { reports = PnlEngine::evaluate(batch, prices); });
+        size_t wrong = 0;
+        PnlReport sum;
+        for (size_t a = 0; a < count; ++a) {
+            const PnlReport &r = reports[a], &e = expected[a];
+            if (r.marketValue != e.marketValue || r.costBasis != e.costBasis || r.unrealized != e.unrealized || r.realized != e.realized) ++wrong;
+            sum.unrealized += e.unrealized;
+            sum.realized += e.realized;
+        }
+        check(wrong == 0, "pnl: every account matches a replay of its trades", to_string(wrong) + " of " + to_string(count) + " differ");
+        PnlReport firm = PnlEngine::total(reports);
+        check(firm.unrealized == sum.unrealized && firm.realized == sum.realized, "pnl: firm total is the sum of the accounts");
+        for (auto s : market) delete s;
     }
-};
 
-class UserPortfolio { // Class representing the user's portfolio
-private:
-    double balance;
-    vector<UserOwnedStock*> ownedStocks;    // Vector to store stocks owned by the user
+    void risk() { // Batch VaR and ES over Monte Carlo scenarios against a full sort of each account's losses
+        const size_t stocks = 500, factors = 4, paths = 20000, count = 200;
+        FactorModel model(stocks, factors, 31);
+        mt19937_64 rng(31);
+        vector<double> vol(stocks);
+        for (size_t i = 0; i < stocks; ++i) {
+            double variance = 0;
+            for (size_t k = 0; k < factors; ++k) {
+                double loading = (k == 0 || rng() % factors == k) ? 0.004 + (rng() % 100) * 1e-4 : 0.0;
+                model.setLoading(i, k, loading);
+                variance += loading * loading;
+            }
+            double idio = 0.005 + (rng() % 100) * 1e-4;
+            model.setIdiosyncraticVol(i, idio);
+            vol[i] = sqrt(variance + idio * idio);
+        }
+        ScenarioSet scenarios(0, 0);
+        time("risk: 20000 Monte Carlo paths of 500 stocks", [&] { scenarios = ScenarioSet::fromFactorModel(model, paths); });
+        double worstVol = 0;
+        for (size_t i = 0; i < stocks; ++i) {
+            const double* r = scenarios.row(i);
+            double sum = 0, squares = 0;
+            for (size_t s = 0; s < paths; ++s) { sum += r[s]; squares += r[s] * r[s]; }
+            double mean = sum / paths;
+            worstVol = max(worstVol, abs(sqrt(squares / paths - mean * mean) / vol[i] - 1));
+        }
+        check(worstVol < 0.05, "risk: Monte Carlo scenarios have the model's volatility", "worst relative error " + to_string(worstVol));
 
-public:
-    UserPortfolio(double initialBalance = 3000.0) : balance(initialBalance) {} // Constructor to initialize portfolio with an initial balance
+        vector<SimulatedStock*> market;
+        vector<double> prices(stocks);
+        for (size_t i = 0; i < stocks; ++i) {
+            prices[i] = 20.0 + i;
+            market.push_back(new SimulatedStock((int)i + 1, "V" + to_string(i + 1), prices[i], "Low"));
+        }
+        vector<unique_ptr<UserPortfolio>> accounts;
+        vector<const UserPortfolio*> batch;
+        for (size_t a = 0; a < count; ++a) {
+            accounts.push_back(make_unique<UserPortfolio>(1e7));
+            for (size_t k = 0, held = 1 + rng() % 40; k < held; ++k) {
+                size_t slot = rng() % stocks;
+                accounts[a]->applyBuy(market[slot], 1 + rng() % 500, prices[slot]);
+            }
+            batch.push_back(accounts[a].get());
+        }
+        vector<RiskReport> reports;
+        time("risk: VaR of 200 accounts over 20000 paths", [&] { reports = RiskEngine::evaluate(batch, prices, scenarios); });
 
-    ~UserPortfolio() { // Destructor to clean up dynamically allocated memory
-        for (auto stock : ownedStocks)
-            delete stock;
+        size_t wrong = 0;
+        vector<double> losses(paths);
+        auto near = [](double a, double b) { return abs(a - b) <= 1e-9 * max(1.0, abs(b)); };
+        for (size_t a = 0; a < count; ++a) {
+            fill(losses.begin(), losses.end(), 0.0);
+            for (const auto& stock : batch[a]->getOwnedStocks()) {
+                size_t slot = stock->getId() - 1;
+                for (size_t s = 0; s < paths; ++s) losses[s] -= stock->getQuantity() * prices[slot] * scenarios.row(slot)[s];
+            }
+            sort(losses.begin(), losses.end());
+            double var95 = losses[(size_t)(0.95 * (paths - 1) + 0.5)], var99 = losses[(size_t)(0.99 * (paths - 1) + 0.5)];
+            double tail95 = 0, tail99 = 0;
+            size_t n95 = 0, n99 = 0;
+            for (double loss : losses) {
+                if (loss >= var95) { tail95 += loss; ++n95; }
+                if (loss >= var99) { tail99 += loss; ++n99; }
+            }
+            const RiskReport& r = reports[a];
+            if (!near(r.var95, var95) || !near(r.var99, var99) || !near(r.es95, tail95 / n95) || !near(r.es99, tail99 / n99)) ++wrong;
+        }
+        check(wrong == 0, "risk: VaR and ES match a sorted reference", to_string(wrong) + " of " + to_string(count) + " differ");
+        for (auto s : market) delete s;
     }
 
-    void display() const {
-        cout << "\n~ This is Your Portfolio ~\n";
-        cout << "Balance: $" << fixed << setprecision(2) << balance << "\n"; // Display current balance
-        if (ownedStocks.empty()) { // Check if there are no stocks owned
-            cout << "No stocks owned yet\n";
-        } else {
-            for (const auto& stock : ownedStocks) // Loop through owned stocks and display each one
-                stock->display();
+    void events() { // Orders and corporate actions land between the ticks in time order, and a day of a million ticks
+        const size_t stocks = 1000, ticksPerDay = 1000;
+        vector<SimulatedStock*> market;
+        for (size_t i = 0; i < stocks; ++i) market.push_back(new SimulatedStock((int)i + 1, "E" + to_string(i + 1), 100.0, "Low"));
+        UserPortfolio user(1e6);
+        EventDrivenMarket simulation(market, user);
+        for (size_t i = 0; i < stocks; ++i) simulation.setTickInterval(i, EventDrivenMarket::sessionMicros / ticksPerDay);
+        uint64_t open = simulation.nextOpen();
+        simulation.schedule({SimEvent::Split, 0, open, 0, 2.0});
+        simulation.schedule({SimEvent::OrderArrival, 0, open + 1, 10, 0.0}); // Before the first tick, so at the split price
+        simulation.schedule({SimEvent::Dividend, 0, open + 2, 0, 1.0});
+        simulation.schedule({SimEvent::OrderArrival, 0, open + EventDrivenMarket::sessionMicros / 2, -4, 0.0});
+        simulation.schedule({SimEvent::OrderArrival, 1, open + EventDrivenMarket::sessionMicros / 2 + 1, -1, 0.0}); // Not held
+        size_t processed = 0;
+        double seconds = time("events: one day of 1000 ticks for 1000 stocks", [&] { processed = simulation.runDay(); });
+        cout << "TIME events: " << fixed << setprecision(1) << processed / seconds / 1e6 << " million events per second\n";
+        check(processed == stocks * ticksPerDay + 5, "events: every tick and event of the day runs once", to_string(processed) + " events");
+
+        vector<EventFill> fills = simulation.takeFills();
+        const UserOwnedStock* held = user.getOwnedStocks().empty() ? nullptr : user.getOwnedStocks()[0];
+        check(fills.size() == 3 && fills[0].status == TradeStatus::Ok && fills[0].price == 50.0 && fills[1].status == TradeStatus::Ok
+                  && fills[2].status == TradeStatus::NotFound && held && held->getQuantity() == 6,
+              "events: orders fill in arrival order after the split");
+        check(fills.size() == 3 && user.getCash() == Money::fromDouble(1e6 - 500 + 10) + Price::fromDouble(fills[1].price) * 4,
+              "events: dividend pays the shares bought before it");
+        for (auto s : market) delete s;
+    }
+
+    void optimizer() { // Four stocks, so a grid over the weight simplex can find the answers by brute force
+        const size_t n = 4, days = 1000, steps = 100;
+        mt19937_64 rng(49); // Both optima hold three of the four stocks, away from the corners
+        normal_distribution<double> normal{0.0, 1.0};
+        double drift[n] = {0.0010, 0.0008, 0.0005, 0.0003}, vol[n] = {0.025, 0.018, 0.012, 0.009};
+        vector<double> values(days * n);
+        for (size_t i = 0; i < n; ++i) values[i] = 100.0;
+        for (size_t d = 1; d < days; ++d) {
+            double market = normal(rng); // Shared factor so the stocks are correlated
+            for (size_t i = 0; i < n; ++i)
+                values[d * n + i] = values[(d - 1) * n + i] * exp(drift[i] + vol[i] * (0.6 * market + 0.8 * normal(rng)));
+        }
+        MeanVarianceOptimizer solver = MeanVarianceOptimizer::fromHistory(PriceTable(move(values), n));
+
+        double bestVariance = HUGE_VAL, bestSharpe = -HUGE_VAL;
+        for (size_t a = 0; a <= steps; ++a)
+            for (size_t b = 0; a + b <= steps; ++b)
+                for (size_t c = 0; a + b + c <= steps; ++c) {
+                    double w[n] = {(double)a / steps, (double)b / steps, (double)c / steps, (double)(steps - a - b - c) / steps};
+                    double mean = 0, variance = 0;
+                    for (size_t i = 0; i < n; ++i) {
+                        mean += w[i] * solver.expectedReturn(i);
+                        for (size_t j = 0; j < n; ++j) variance += w[i] * w[j] * solver.covariance(i, j);
+                    }
+                    bestVariance = min(bestVariance, variance);
+                    if (variance > 0) bestSharpe = max(bestSharpe, mean / sqrt(variance));
+                }
+
+        FrontierPoint minimum = solver.minimumVariance(), sharpe = solver.maxSharpe();
+        double variance = minimum.volatility * minimum.volatility;
+        check(variance <= bestVariance * (1 + 1e-6) && variance >= bestVariance * (1 - 1e-2), "optimizer: minimum variance matches a brute-force grid",
+              "relative gap " + to_string(variance / bestVariance - 1));
+        check(sharpe.sharpe >= bestSharpe - 1e-6 && sharpe.sharpe <= bestSharpe * (1 + 1e-2), "optimizer: max Sharpe matches a brute-force grid",
+              "relative gap " + to_string(sharpe.sharpe / bestSharpe - 1));
+
+        const size_t wide = 4000, history = 250; // Far fewer days than stocks, the shape the thin return products are for
+        vector<double> prices(wide * history);
+        for (size_t i = 0; i < wide; ++i) prices[i] = 100.0;
+        for (size_t d = 1; d < history; ++d) {
+            double market = normal(rng);
+            for (size_t i = 0; i < wide; ++i)
+                prices[d * wide + i] = prices[(d - 1) * wide + i] * exp(0.0003 + 0.015 * (0.5 * market + 0.85 * normal(rng)));
         }
+        PriceTable table(move(prices), wide);
+        MeanVarianceOptimizer large({}, {});
+        time("optimizer: covariance of 4000 stocks x 250 days", [&] { large = MeanVarianceOptimizer::fromHistory(table); });
+        time("optimizer: minimum variance of 4000 stocks", [&] { minimum = large.minimumVariance(); });
+        time("optimizer: max Sharpe of 4000 stocks", [&] { sharpe = large.maxSharpe(); });
+        double total = 0;
+        for (double w : sharpe.weights) total += w;
+        check(abs(total - 1) < 1e-9 && sharpe.sharpe >= minimum.sharpe, "optimizer: 4000-stock max Sharpe is a portfolio beating minimum variance");
     }
 
-    void buyStock(SimulatedStock* s, int qty) { // Function to buy stocks
-        double total = s->getPrice() * qty;  // Calculate total cost of stocks to be bought
-        if (total > balance) { // Check if the user has enough balance
-            cout << "Insufficient balance.\n"; 
-            return;
+    void rebalancer() { // Diversified universes still trade, and the nightly batch plans each account as plan() would alone
+        const size_t wide = 8000;
+        mt19937_64 rng(47);
+        vector<SimulatedStock*> market;
+        vector<double> prices(wide);
+        for (size_t i = 0; i < wide; ++i) {
+            prices[i] = 10.0 + (rng() % 49000) / 100.0;
+            market.push_back(new SimulatedStock((int)i + 1, "R" + to_string(i + 1), prices[i], "Low"));
         }
-        balance -= total;
+        vector<unique_ptr<UserPortfolio>> accounts;
+        for (double balance : {1e7, 2e7, 250000.0, 3000.0, 0.0}) accounts.push_back(make_unique<UserPortfolio>(balance));
+        Rebalancer rebalancer(Rebalancer::equalWeights(wide, 0.99));
+        Rebalancer::applyTrades(*accounts[1], Rebalancer(Rebalancer::equalWeights(wide / 2)).plan(*accounts[1], prices), market, prices);
 
-        for (auto& stock : ownedStocks) { // Check if the stock is already owned
-            if (stock->getName() == s->getName()) {
-                stock->buy(qty); // If already owned, increase the quantity
-                return;
+        vector<const UserPortfolio*> batch;
+        for (const auto& a : accounts) batch.push_back(a.get());
+        vector<RebalancePlan> plans;
+        time("rebalancer: nightly batch of 5 accounts over 8000 stocks", [&] { plans = rebalancer.planAll(batch, prices); });
+        bool same = plans.size() == batch.size();
+        for (size_t a = 0; same && a < batch.size(); ++a) {
+            RebalancePlan alone = rebalancer.plan(*batch[a], prices);
+            same = alone.trades.size() == plans[a].trades.size() && alone.trackingErrorAfter == plans[a].trackingErrorAfter;
+            for (size_t t = 0; same && t < alone.trades.size(); ++t)
+                same = alone.trades[t].slot == plans[a].trades[t].slot && alone.trades[t].quantity == plans[a].trades[t].quantity;
+        }
+        check(same, "rebalancer: batch plans match planning each account alone");
+
+        char detail[80];
+        snprintf(detail, sizeof detail, "%zu trades, tracking error %.4f -> %.4f", plans[0].trades.size(), plans[0].trackingErrorBefore,
+                 plans[0].trackingErrorAfter);
+        check(plans[0].trades.size() > wide * 9 / 10 && plans[0].trackingErrorAfter < plans[0].trackingErrorBefore / 10,
+              "rebalancer: empty $10M account buys into 8000 names", detail);
+        snprintf(detail, sizeof detail, "tracking error %.4f -> %.4f", plans[1].trackingErrorBefore, plans[1].trackingErrorAfter);
+        check(plans[1].trackingErrorAfter < plans[1].trackingErrorBefore / 5, "rebalancer: account holding half the universe spreads out", detail);
+        check(plans[4].trades.empty(), "rebalancer: account without equity is left alone");
+
+        Rebalancer::applyTrades(*accounts[0], plans[0], market, prices);
+        for (double& p : prices) p *= 1.001; // A small uniform move stays inside the band
+        RebalancePlan again = rebalancer.plan(*accounts[0], prices);
+        check(again.trades.empty(), "rebalancer: a rebalanced account does not trade on a small move", to_string(again.trades.size()) + " trades");
+        for (auto s : market) delete s;
+    }
+
+    void indices() { // Incremental levels against an exact recompute, at the size the calculator is meant for
+        const size_t stocks = 100000, count = 300, moves = 1000, ticks = 1000;
+        mt19937_64 rng(49);
+        uniform_int_distribution<uint32_t> pick(0, stocks - 1);
+        normal_distribution<double> normal{0.0, 1.0};
+        vector<double> prices(stocks);
+        for (double& p : prices) p = 20.0 + (rng() % 50000) / 100.0;
+        IndexCalculator calculator(prices, 0); // Never recomputes, so the drift below is all accumulated rounding
+        for (size_t x = 0; x < count; ++x) {
+            IndexDefinition definition;
+            definition.name = "Index " + to_string(x);
+            definition.weighting = x % 3 == 0 ? IndexWeighting::Price : x % 3 == 1 ? IndexWeighting::Cap : IndexWeighting::Equal;
+            if (definition.weighting == IndexWeighting::Equal) definition.rebalanceEvery = 50;
+            size_t members = x % 10 == 0 ? 5000 : 500; // A few broad indices among many narrow ones
+            for (size_t k = 0; k < members; ++k) {
+                definition.constituents.push_back(pick(rng));
+                definition.shares.push_back(1000.0 + rng() % 100000);
             }
+            calculator.add(move(definition));
         }
-        ownedStocks.push_back(new UserOwnedStock(s, qty)); // If not owned, create a new UserOwnedStock and add it to the portfolio
+
+        vector<vector<uint32_t>> changed(ticks, vector<uint32_t>(moves));
+        vector<vector<double>> returns(ticks, vector<double>(moves));
+        for (size_t t = 0; t < ticks; ++t)
+            for (size_t c = 0; c < moves; ++c) {
+                changed[t][c] = pick(rng);
+                returns[t][c] = 0.01 * normal(rng);
+            }
+        double seconds = time("indices: 1000 ticks of 1000 moves over 300 indices of 100k stocks", [&] {
+            for (size_t t = 0; t < ticks; ++t) {
+                for (size_t c = 0; c < moves; ++c) prices[changed[t][c]] *= 1 + returns[t][c];
+                calculator.update(changed[t].data(), moves, prices.data());
+            }
+        });
+        cout << "TIME indices: " << fixed << setprecision(1) << seconds / ticks * 1e6 << " us per tick\n";
+
+        IndexCalculator exact = calculator;
+        exact.recompute();
+        double drift = 0;
+        for (size_t x = 0; x < count; ++x) drift = max(drift, abs(calculator.level(x) / exact.level(x) - 1));
+        char detail[48];
+        snprintf(detail, sizeof detail, "relative drift %.1e", drift);
+        check(drift < 1e-9, "indices: incremental levels match an exact recompute", detail);
     }
 
-    void sellStock(string stockName, int qty) { // Function to sell stocks
-        for (size_t i = 0; i < ownedStocks.size(); ++i) { // Loop through owned stocks to find the stock to sell
-            if (ownedStocks[i]->getName() == stockName) {
-                if (ownedStocks[i]->getQuantity() >= qty) { // Check if the user has enough quantity to sell
-                    double income = qty * ownedStocks[i]->getPrice(); // Calculate income from selling stocks
-                    ownedStocks[i]->sell(qty); // Decrease the quantity of stocks owned
-                    balance += income;
-                    if (ownedStocks[i]->getQuantity() == 0) { // If quantity becomes zero, remove the stock from the portfolio
-                        delete ownedStocks[i];
-                        ownedStocks.erase(ownedStocks.begin() + i);   
+    void server() { // Pipelined requests from one client over a Unix socket, every answer checked against the request it belongs to
+        const size_t requests = 2000000, buyEvery = 1000, batch = 4096;
+        auto opOf = [&](size_t n) -> uint8_t { return n + 1 == requests ? Wire::Balance : n % buyEvery == 0 ? Wire::Buy : Wire::Quote; };
+        SimulatedStock stock(1, "Server", 100.0, "Low");
+        vector<SimulatedStock*> market = {&stock};
+        string path = "/tmp/stocksim-selftest-" + to_string(getpid()) + ".sock";
+        TradingServer trading(market, 1, 1000000.0);
+        trading.listenUnix(path);
+        thread loop([&] { trading.run(); });
+
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        strcpy(address.sun_path, path.c_str());
+        bool connected = fd >= 0 && connect(fd, (sockaddr*)&address, sizeof address) == 0;
+        size_t answered = 0, matching = 0;
+        int64_t price = Price::fromDouble(100.0).getTicks();
+        if (connected) {
+            thread writer([&] { // Never waits for answers, so the server sees deep pipelines
+                vector<Wire::Request> frames(batch);
+                for (size_t sent = 0; sent < requests; sent += batch) {
+                    for (size_t k = 0; k < batch; ++k) {
+                        size_t n = sent + k;
+                        frames[k] = Wire::Request{};
+                        frames[k].op = opOf(n);
+                        frames[k].stockId = 1;
+                        frames[k].quantity = 1;
                     }
-                    return;
-                } else {
-                    cout << "Not enough quantity.\n";
-                    return;
+                    size_t bytes = min(batch, requests - sent) * sizeof(Wire::Request), offset = 0;
+                    while (offset < bytes) {
+                        ssize_t n = ::send(fd, (const char*)frames.data() + offset, bytes - offset, MSG_NOSIGNAL);
+                        if (n <= 0) return;
+                        offset += n;
+                    }
+                }
+            });
+            double seconds = time("server: 2M pipelined requests over a Unix socket", [&] {
+                vector<char> buffer(batch * sizeof(Wire::Response));
+                size_t pending = 0; // Bytes of a response split across reads
+                while (answered < requests) {
+                    ssize_t n = ::recv(fd, buffer.data() + pending, buffer.size() - pending, 0);
+                    if (n <= 0) break;
+                    size_t whole = (pending + n) / sizeof(Wire::Response);
+                    for (size_t k = 0; k < whole; ++k) { // Buys so far set the balance, so a reordered answer shows
+                        Wire::Response r;
+                        memcpy(&r, buffer.data() + k * sizeof r, sizeof r);
+                        size_t n = answered + k;
+                        int64_t balance = Money::fromDouble(1000000.0 - 100.0 * (n / buyEvery + 1)).getTicks();
+                        if (r.status == Wire::Ok && r.op == opOf(n) && r.stockId == 1 && r.price == price && r.balance == balance) ++matching;
+                    }
+                    answered += whole;
+                    pending = (pending + n) % sizeof(Wire::Response);
+                    memmove(buffer.data(), buffer.data() + whole * sizeof(Wire::Response), pending);
                 }
+            });
+            writer.join();
+            cout << "TIME server: " << (long long)(seconds > 0 ? requests / seconds : 0) << " requests per second\n";
+        }
+        if (fd >= 0) ::close(fd);
+        trading.stop();
+        loop.join();
+
+        check(connected && answered == requests, "server: every pipelined request is answered", to_string(answered) + " answers");
+        check(matching == requests, "server: answers arrive in request order with the right payload", to_string(requests - matching) + " mismatched");
+    }
+
+    void intraday() { // Bars built from known ticks, and a simulated day's bars against each other
+        SimulatedStock stock(1, "Bars", 50.0, "High");
+        vector<SimulatedStock*> market = {&stock};
+        IntradayBook book(1, 390, {60, 300, 1800, IntradayBook::sessionSeconds}, 2, 36);
+        check(book.resolutionCount() == 3 && book.resolution(0) == 300, "intraday: bars no longer than the tick interval are not kept");
+
+        book.beginDay({50.0});
+        double prices[] = {50.0, 51.5, 49.25, 50.75, 52.0, 48.5, 49.0};
+        uint32_t volume = 0;
+        for (size_t t = 0; t < size(prices); ++t) {
+            book.addTick(0, (uint32_t)(t * 3000), prices[t], 100 * (uint32_t)(t + 1));
+            volume += 100 * (uint32_t)(t + 1);
+        }
+        book.endDay();
+        const Bar& dayBar = book.bar(2, 0, 0, 0);
+        check(dayBar.open == 50.0f && dayBar.high == 52.0f && dayBar.low == 48.5f && dayBar.close == 49.0f && dayBar.volume == volume,
+              "intraday: daily bar holds the open, high, low, close and volume of its ticks");
+        const Bar& quiet = book.bar(1, 0, 2, 0); // 1:00-1:30 after the open has no tick, it repeats the 0:50 close
+        check(quiet.volume == 0 && quiet.open == 51.5f && quiet.close == 51.5f, "intraday: buckets without ticks repeat the previous close");
+
+        for (int d = 0; d < 3; ++d) book.simulateDay(market); // Two days kept, the ring has wrapped
+        bool consistent = book.daysKept() == 2;
+        for (size_t ago = 0; ago < book.daysKept(); ++ago) {
+            const Bar& daily = book.bar(2, ago, 0, 0);
+            float high = 0, low = HUGE_VALF;
+            uint64_t total = 0;
+            for (size_t b = 0; b < book.bucketCount(0); ++b) {
+                const Bar& bar = book.bar(0, ago, b, 0);
+                high = max(high, bar.high);
+                low = min(low, bar.low);
+                total += bar.volume;
             }
+            float close = book.bar(0, ago, book.bucketCount(0) - 1, 0).close;
+            consistent &= daily.high == high && daily.low == low && daily.volume == total && daily.close == close;
         }
-        cout << "Stock not found in portfolio.\n";
+        check(consistent && book.bar(2, 0, 0, 0).close == (float)stock.getPrice(), "intraday: simulated daily bars agree with the 5-minute bars and the close");
     }
 
-    void updatePrices() { // Function to update prices of all owned stocks
-        for (auto& stock : ownedStocks)
-            stock->updatePrice();
+    void sharedMemory() { // A reader's snapshot never mixes two publishes, even while the writer keeps publishing
+        const size_t stocks = 1 << 16, publishes = 3000; // Long copies, so even one core preempts readers mid-snapshot
+        vector<SimulatedStock*> market;
+        for (size_t i = 0; i < stocks; ++i) market.push_back(new SimulatedStock((int)i + 1, "S" + to_string(i + 1), 1.0, "Low"));
+        string name = "/stocksim-selftest-" + to_string(getpid());
+        size_t snapshots = 0, torn = 0;
+        try {
+            unique_ptr<SharedMarket> writer = SharedMarket::create(name, market);
+            unique_ptr<SharedMarket> reader = SharedMarket::open(name);
+            bool refused = false;
+            try {
+                SharedMarket::create(name, market);
+            } catch (const runtime_error&) {
+                refused = true;
+            }
+            check(refused && SharedMarket::open(name)->instrument(0).id == 1, "shm: a second writer is refused and leaves the segment alone");
+            atomic<bool> done{false};
+            thread publisher([&] { // Every price of publish t equals t, so a torn copy shows two values
+                vector<double> prices(stocks);
+                for (size_t t = 1; t <= publishes; ++t) {
+                    fill(prices.begin(), prices.end(), (double)t);
+                    writer->publish(prices, t);
+                }
+                done = true;
+            });
+            vector<double> seen;
+            while (!done.load()) {
+                uint64_t tick = reader->snapshot(seen);
+                ++snapshots;
+                for (double p : seen)
+                    if (p != (tick ? (double)tick : 1.0)) { ++torn; break; }
+            }
+            publisher.join();
+            uint64_t tick = reader->snapshot(seen);
+            check(tick == publishes && seen.back() == publishes && reader->instrument(stocks - 1).id == (int)stocks, "shm: reader sees the last publish and the writer's stocks");
+        } catch (const exception& e) {
+            check(false, "shm: segment can be created and mapped", e.what());
+        }
+        for (auto s : market) delete s;
+        check(snapshots > 0 && torn == 0, "shm: snapshots stay consistent while publish runs",
+              to_string(snapshots) + " snapshots, " + to_string(torn) + " torn");
     }
 
-    double getBalance() const { return balance; } // Getter for current balance
+public:
+    int run() { // Process exit code
+        lots();
+        pnl();
+        risk();
+        events();
+        optimizer();
+        rebalancer();
+        indices();
+        server();
+        intraday();
+        sharedMemory();
+        cout << (failures ? to_string(failures) + " checks failed\n" : "All checks passed\n");
+        return failures ? 1 : 0;
+    }
 };
 
 } // namespace StockSim
@@ -168,11 +4275,72 @@ public:
 using namespace StockSim; // Use the StockSim namespace to access the stock simulation classes
 using namespace std;
 
+static TradingServer* activeServer = nullptr; // Server stopped by Ctrl+C
+static SessionServer* activeSessionServer = nullptr;
 
+static volatile sig_atomic_t interrupted = 0; // Set by Ctrl+C, polled by the shared-memory reader
+
+static void stopServer(int) {
+    if (activeServer) activeServer->stop();
+    if (activeSessionServer) activeSessionServer->stop();
+    interrupted = 1;
+}
 
-int main() {
+int main(int argc, char* argv[]) {
     srand(time(0)); // Seed the random number generator for price updates
 
+    size_t shardCount = 0; // Number of market shard threads, 0 runs everything on the main thread
+    bool useFactorModel = false; // Correlated ticks from a factor model instead of independent moves
+    bool runSweep = false; // Run a volatility/balance parameter sweep and exit
+    bool runSelfTest = false; // Run the built-in checks and exit
+    LotRelief relief = LotRelief::Fifo; // Tax lots the menu's sales relieve first
+    string marketFile; // Instrument file replacing the built-in market
+    string saveMarketFile; // Where to write the market as a binary instrument file, then exit
+    string replayFile; // Recorded prices replayed instead of random ticks
+    string recordFile; // Where to record the simulated price history on exit
+    size_t intradayTicks = 0; // Ticks per stock per day, 0 keeps one move per day
+    bool eventDriven = false; // Stocks tick at their own frequencies from an event queue
+    double tickSeconds = 0; // Tick interval of every stock in event-driven mode, 0 keeps the risk-based frequencies
+    string metricsFile; // Where to write Prometheus metrics on exit
+    string traceFile; // Where to write a Chrome trace of the session on exit
+    string serveUnix; // Unix socket path for server mode
+    int serveTcp = 0; // Loopback TCP port for server mode
+    size_t accountCount = 1000; // Accounts available to server clients
+    size_t reactorCount = 0; // Reactor threads for coroutine sessions, 0 keeps the single-threaded server
+    int publishPort = 0; // Loopback UDP port for market data, 0 disables publishing
+    string shmName; // POSIX shared-memory segment for out-of-process readers
+    string shmRead; // Segment of another simulator to follow instead of simulating
+    for (int i = 1; i < argc; ++i) { // Parse command line options
+        string arg = argv[i];
+        if (arg == "--shards" && i + 1 < argc) shardCount = stoul(argv[++i]);
+        else if (arg == "--factor-model") useFactorModel = true;
+        else if (arg == "--sweep") runSweep = true;
+        else if (arg == "--self-test") runSelfTest = true;
+        else if (arg == "--lifo") relief = LotRelief::Lifo;
+        else if (arg == "--market" && i + 1 < argc) marketFile = argv[++i];
+        else if (arg == "--save-market" && i + 1 < argc) saveMarketFile = argv[++i];
+        else if (arg == "--replay" && i + 1 < argc) replayFile = argv[++i];
+        else if (arg == "--record" && i + 1 < argc) recordFile = argv[++i];
+        else if (arg == "--intraday" && i + 1 < argc) intradayTicks = stoul(argv[++i]);
+        else if (arg == "--event-driven") eventDriven = true;
+        else if (arg == "--tick-every" && i + 1 < argc) tickSeconds = stod(argv[++i]);
+        else if (arg == "--metrics" && i + 1 < argc) metricsFile = argv[++i];
+        else if (arg == "--trace" && i + 1 < argc) traceFile = argv[++i];
+        else if (arg == "--serve" && i + 1 < argc) serveUnix = argv[++i];
+        else if (arg == "--serve-tcp" && i + 1 < argc) serveTcp = stoi(argv[++i]);
+        else if (arg == "--accounts" && i + 1 < argc) accountCount = stoul(argv[++i]);
+        else if (arg == "--reactors" && i + 1 < argc) reactorCount = stoul(argv[++i]);
+        else if (arg == "--publish" && i + 1 < argc) publishPort = stoi(argv[++i]);
+        else if (arg == "--shm" && i + 1 < argc) shmName = argv[++i];
+        else if (arg == "--shm-read" && i + 1 < argc) shmRead = argv[++i];
+    }
+
+#ifndef STOCKSIM_NO_TRACE
+    if (!traceFile.empty()) TraceRecorder::instance().enable();
+#endif
+
+    if (runSelfTest) return SelfTest().run();
+
     vector<SimulatedStock*> market = { // Initialize the market with simulated stocks
         new SimulatedStock(1, "Apple", 211.0, "Medium"),
         new SimulatedStock(2, "Google", 165.0, "Medium"),
@@ -185,7 +4353,216 @@ int main() {
         new SimulatedStock(9, "META", 643.0, "High")
     };
 
+    if (!marketFile.empty()) { // Replace the built-in market with one loaded from a file
+        try {
+            vector<SimulatedStock*> loaded = MarketLoader::load(marketFile).makeStocks();
+            for (auto s : market) delete s;
+            market = loaded;
+        } catch (const exception& e) {
+            cout << "Could not load market: " << e.what() << "\n";
+            for (auto s : market) delete s;
+            return 1;
+        }
+    }
+
+    if (!saveMarketFile.empty()) { // Convert, e.g. a CSV given with --market, to the binary format that loads without parsing
+        try {
+            MarketLoader::saveBinary(MarketDefinition::fromStocks(market), saveMarketFile);
+            cout << "Saved " << market.size() << " stocks to " << saveMarketFile << "\n";
+        } catch (const exception& e) {
+            cout << "Could not save market: " << e.what() << "\n";
+            for (auto s : market) delete s;
+            return 1;
+        }
+        for (auto s : market) delete s;
+        return 0;
+    }
+
+    if (runSweep) { // Grid over volatility scale and initial balance
+        MarketDefinition definition = MarketDefinition::fromStocks(market);
+        vector<SimulationConfig> configs;
+        for (double scale : {0.5, 1.0, 1.5, 2.0})
+            for (double balance : {1000.0, 3000.0, 10000.0}) {
+                SimulationConfig config;
+                config.volatility = {0.05 * scale, 0.1 * scale, 0.2 * scale};
+                config.initialBalance = balance;
+                config.seed = configs.size() + 1;
+                configs.push_back(config);
+            }
+        cout << "\n~ Parameter sweep (" << configs[0].paths << " paths x " << configs[0].days << " days) ~\n";
+        for (const auto& s : SweepRunner(definition).run(configs))
+            cout << fixed << setprecision(3) << "Vol " << s.config.volatility.low << "/" << s.config.volatility.medium << "/" << s.config.volatility.high << setprecision(2)
+                 << " | Balance $" << setw(8) << s.config.initialBalance << " | Mean $" << setw(9) << s.mean << " | Std $" << setw(9) << s.stddev
+                 << " | Min $" << setw(9) << s.min << " | Max $" << setw(10) << s.max << " | Return " << s.meanReturn * 100 << "%\n";
+        for (auto s : market) delete s;
+        return 0;
+    }
+
+    if (!shmRead.empty()) { // Print another simulator's prices whenever it publishes a new day
+        try {
+            unique_ptr<SharedMarket> feed = SharedMarket::open(shmRead);
+            signal(SIGINT, stopServer);
+            cout << "Following " << feed->size() << " stocks in " << shmRead << ", press Ctrl+C to stop\n";
+            vector<double> current;
+            uint64_t shown = UINT64_MAX;
+            while (!interrupted) {
+                uint64_t tick = feed->snapshot(current); // Consistent across stocks even while the writer publishes
+                if (tick != shown) {
+                    shown = tick;
+                    cout << "\n~ Day " << tick << " ~\n";
+                    for (size_t i = 0; i < feed->size(); ++i)
+                        cout << setw(2) << feed->instrument(i).id << ". " << setw(12) << feed->instrument(i).name
+                             << " | $" << setw(8) << fixed << setprecision(2) << current[i] << "\n";
+                }
+                this_thread::sleep_for(chrono::milliseconds(100));
+            }
+        } catch (const exception& e) {
+            cout << "Could not read shared memory: " << e.what() << "\n";
+            for (auto s : market) delete s;
+            return 1;
+        }
+        for (auto s : market) delete s;
+        return 0;
+    }
+
+    auto reportAccounts = [&](auto& server) { // End-of-day P&L over every served account, at the last market prices
+        vector<const UserPortfolio*> accounts;
+        for (size_t i = 0; i < accountCount; ++i) accounts.push_back(&server.account(i));
+        vector<double> closing;
+        for (auto s : market) closing.push_back(s->getPrice());
+        PnlReport firm = PnlEngine::total(PnlEngine::evaluate(accounts, closing));
+        cout << "Firm P&L: holdings $" << firm.marketValue << " | Unrealized $" << firm.unrealized << " | Realized $" << firm.realized << "\n";
+        ScenarioSet history = ScenarioSet::fromHistory(market);
+        if (history.scenarioCount() < 2) return; // Too few simulated days for historical VaR
+        vector<RiskReport> risk = RiskEngine::evaluate(accounts, closing, history);
+        size_t worst = 0;
+        for (size_t i = 1; i < risk.size(); ++i)
+            if (risk[i].var99 > risk[worst].var99) worst = i;
+        if (!risk.empty())
+            cout << "Largest 1-day VaR 99%: $" << risk[worst].var99 << " (ES $" << risk[worst].es99 << ") in account " << worst << "\n";
+    };
+
+    if ((!serveUnix.empty() || serveTcp > 0) && reactorCount > 0) { // Coroutine sessions on reactor threads
+        try {
+            SessionServer server(market, accountCount, reactorCount);
+            if (!serveUnix.empty()) server.listenUnix(serveUnix);
+            else server.listenTcp((uint16_t)serveTcp);
+            server.tickEvery(1000);
+            activeSessionServer = &server;
+            signal(SIGINT, stopServer);
+            cout << "Serving " << accountCount << " accounts on " << reactorCount << " reactors, press Ctrl+C to stop\n";
+            server.run();
+            activeSessionServer = nullptr;
+            cout << "\nServed " << server.requestsServed() << " requests over " << server.sessionsAccepted() << " sessions\n";
+            reportAccounts(server);
+        } catch (const exception& e) {
+            cout << "Server error: " << e.what() << "\n";
+        }
+        for (auto s : market) delete s;
+        return 0;
+    }
+
+    if (!serveUnix.empty() || serveTcp > 0) { // Serve clients instead of the menu
+        try {
+            TradingServer server(market, accountCount);
+            if (!serveUnix.empty()) server.listenUnix(serveUnix);
+            else server.listenTcp((uint16_t)serveTcp);
+            server.tickEvery(1000); // One simulated day per second
+            activeServer = &server;
+            signal(SIGINT, stopServer);
+            cout << "Serving " << accountCount << " accounts, press Ctrl+C to stop\n";
+            server.run();
+            activeServer = nullptr;
+            cout << "\nServed " << server.requestsServed() << " requests\n";
+            reportAccounts(server);
+        } catch (const exception& e) {
+            cout << "Server error: " << e.what() << "\n";
+        }
+        for (auto s : market) delete s;
+        return 0;
+    }
+
+    unique_ptr<ReplayFeed> replay; // Optional recorded prices, one row per day
+    if (!replayFile.empty()) {
+        try {
+            replay = make_unique<ReplayFeed>(replayFile);
+            if (replay->instrumentCount() != market.size())
+                throw runtime_error(replayFile + ": recorded " + to_string(replay->instrumentCount()) + " instruments, the market has " + to_string(market.size()));
+        } catch (const exception& e) {
+            cout << "Could not open replay: " << e.what() << "\n";
+            for (auto s : market) delete s;
+            return 1;
+        }
+    }
+
+    unique_ptr<ShardedMarket> sharded; // Optional sharded market running trades and ticks on shard threads
+    if (shardCount > 0) sharded = make_unique<ShardedMarket>(market, shardCount);
+
+    PriceBoard board(market.size()); // Published prices for lock-free readers
+    board.publish(market, 0);
+    uint64_t day = 0; // Number of simulated days
+    vector<double> prices; // Scratch buffer for price snapshots
+    board.snapshot(prices);
+    IndicatorBook indicators(prices); // Indicators maintained as days are simulated
+    unique_ptr<SharedMarket> shared; // Optional shared-memory copy of the prices
+    if (!shmName.empty()) {
+        try {
+            shared = SharedMarket::create(shmName, market);
+        } catch (const exception& e) {
+            cout << "Shared memory disabled: " << e.what() << "\n";
+        }
+    }
+    unique_ptr<MarketDataPublisher> publisher; // Optional binary price feed for other processes
+    if (publishPort > 0) {
+        try {
+            publisher = make_unique<MarketDataPublisher>((uint16_t)publishPort, market.size());
+            publisher->publish(prices, 0);
+        } catch (const exception& e) {
+            cout << "Market data disabled: " << e.what() << "\n";
+        }
+    }
+    CovarianceMatrix covariance(prices); // Co-movement of the market, used for portfolio risk
+    IndexCalculator indices(prices); // Market-wide indices, moved by the stocks that changed each day
+    {
+        IndexDefinition all;
+        for (size_t i = 0; i < market.size(); ++i) all.constituents.push_back((uint32_t)i);
+        all.name = "StockSim Price";
+        indices.add(all);
+        all.name = "StockSim Equal";
+        all.weighting = IndexWeighting::Equal;
+        all.rebalanceEvery = 5; // Weekly
+        indices.add(all);
+    }
+    auto corporateAction = [&](size_t slot, double factor, double splitRatio) { // Earlier prices scale by factor, splitRatio is 0 for a dividend
+        indicators.adjust(slot, factor);
+        covariance.adjust(slot, factor);
+        if (splitRatio > 0) indices.applySplit((uint32_t)slot, splitRatio); // Index levels don't move on a split
+    };
+
+    unique_ptr<FactorModel> factorModel; // Optional correlated price simulation, sectors follow risk levels
+    if (useFactorModel) factorModel = make_unique<FactorModel>(FactorModel::riskSectorModel(market));
+
+    unique_ptr<IntradayBook> intraday; // Optional intraday ticks aggregated into 1m/5m/1d bars
+    if (intradayTicks > 0) intraday = make_unique<IntradayBook>(market.size(), intradayTicks);
+
     UserPortfolio user; // Create a user portfolio with an initial balance
+    user.setLotRelief(relief);
+    auto settleOrders = [&] { // Apply the shards' fills before anything reads or moves the portfolio or prices
+        if (!sharded) return;
+        sharded->wait();
+        for (const auto& fill : sharded->takeFills()) {
+            TradeStatus status = ShardedMarket::settle(user, fill);
+            if (status == TradeStatus::InsufficientBalance) cout << "Order for " << fill.stock->getName() << " not filled: insufficient balance.\n";
+            else if (status != TradeStatus::Ok) cout << "Order for " << fill.stock->getName() << " not filled: not enough quantity.\n";
+        }
+    };
+    unique_ptr<EventDrivenMarket> events; // Optional event queue, high risk stocks tick most often
+    if (eventDriven) {
+        events = make_unique<EventDrivenMarket>(market, user);
+        events->setCorporateActionHandler(corporateAction);
+        if (tickSeconds > 0)
+            for (size_t i = 0; i < market.size(); ++i) events->setTickInterval(i, (uint64_t)(tickSeconds * 1e6));
+    }
     int choice;
     do{
         cout << "\n~ This is investment simulator ~\n";
@@ -194,18 +4571,32 @@ int main() {
         cout << "3. Sell stock\n";
         cout << "4. Show portfolio\n";
         cout << "5. Simulate next day\n";   
+        cout << "6. Show indicators\n";
+        cout << "7. Backtest strategies\n";
+        cout << "8. Rebalance to equal weights\n";
+        cout << "9. Optimize portfolio\n";
+        cout << "10. Corporate action\n";
+        cout << "11. Sell a tax lot\n";
+        cout << "12. Show intraday bars\n";
         cout << "0. Exit\n";
         cout << "Please, choose an action(number): ";
         cin >> choice;
+        settleOrders(); // Orders sent by the last action were in flight while the user chose this one
 
         switch (choice) {
-            case 1:
+            case 1: {
+                STOCKSIM_TIMED(Render);
+                STOCKSIM_TRACE("render");
                 cout << "\n~ Market Stocks ~\n";
-                for (auto& s : market) { // Loop through the market and display each stock
-                    s->display();
-                    cout << "\n";
+                uint64_t tick = board.snapshot(prices); // Consistent prices for the whole market
+                for (size_t i = 0; i < market.size(); ++i) { // Loop through the market and display each stock
+                    market[i]->displayQuote(prices[i]);
+                    cout << " | Day " << tick + 1 << "\n";
                 }
+                for (size_t x = 0; x < indices.size(); ++x)
+                    cout << setw(16) << indices.name(x) << " | " << fixed << setprecision(2) << indices.level(x) << "\n";
                 break;
+            }
             case 2: {
                 int id, qty; 
                 cout << "Enter stock ID to buy: \n";
@@ -216,8 +4607,20 @@ int main() {
                 cin >> id;
                 cout << "Enter quantity: ";
                 cin >> qty;
-                if (id >= 1 && id <= market.size()) { // Check if the entered ID is valid
-                    user.buyStock(market[id - 1], qty); // Buy the stock with the specified ID and quantity
+                if (id >= 1 && id <= (int)market.size()) { // Check if the entered ID is valid
+                    if (sharded) { // Priced on the shard that owns the stock while the menu carries on
+                        sharded->submitBuy(market[id - 1]->getId(), qty);
+                        cout << "Order sent, it settles at the shard price.\n";
+                    } else if (events) { // Arrives just after the next session opens
+                        if (qty <= 0) {
+                            cout << "Invalid quantity.\n";
+                            break;
+                        }
+                        events->schedule({SimEvent::OrderArrival, (uint32_t)(id - 1), events->nextOpen() + 1, qty, 0.0});
+                        cout << "Order queued, it fills at the market price when the next day opens.\n";
+                    } else {
+                        user.buyStock(market[id - 1], qty); // Buy the stock with the specified ID and quantity
+                    }
                 } else {
                     cout << "Invalid ID.\n";
                 }
@@ -231,20 +4634,245 @@ int main() {
                 getline(cin, name); // Read the stock name including spaces
                 cout << "Enter quantity: ";
                 cin >> qty;
-                user.sellStock(name, qty);
+                if (sharded || events) { // Price the sale on the shard that owns the stock, or when the next day opens
+                    int id = 0;
+                    for (const auto& stock : user.getOwnedStocks())
+                        if (stock->getName() == name) id = stock->getId();
+                    if (!id) {
+                        cout << "Stock not found in portfolio.\n";
+                        break;
+                    }
+                    if (sharded) {
+                        sharded->submitSell(id, qty);
+                        cout << "Order sent, it settles at the shard price.\n";
+                    } else if (qty <= 0) {
+                        cout << "Invalid quantity.\n";
+                    } else {
+                        events->schedule({SimEvent::OrderArrival, (uint32_t)(id - 1), events->nextOpen() + 1, -qty, 0.0});
+                        cout << "Order queued, it fills at the market price when the next day opens.\n";
+                    }
+                } else {
+                    user.sellStock(name, qty);
+                }
                 break;
             }
             case 4:
                 user.display(); // Display the user's portfolio
+                board.snapshot(prices);
+                {
+                    PnlReport pnl = user.getPnl(prices.data(), prices.size());
+                    cout << "Cost basis: $" << pnl.costBasis << " | Unrealized P&L: $" << pnl.unrealized << "\n";
+                }
+                if (covariance.getSamples() > 1) { // Risk needs at least two simulated days
+                    cout << "Estimated daily risk: $" << sqrt(covariance.portfolioVariance(user.getExposures(prices))) << "\n";
+                }
+                if (day >= 5) { // Historical VaR over the simulated days
+                    vector<pair<size_t, double>> positions;
+                    vector<double> losses;
+                    RiskReport risk = RiskEngine::evaluate(user, prices, ScenarioSet::fromHistory(market), positions, losses);
+                    cout << "1-day VaR 95%: $" << risk.var95 << " (ES $" << risk.es95 << ")"
+                         << " | 99%: $" << risk.var99 << " (ES $" << risk.es99 << ")\n";
+                }
+                if (factorModel && !user.getOwnedStocks().empty()) { // Monte Carlo VaR from a fresh draw of the same model
+                    FactorModel paths = FactorModel::riskSectorModel(market);
+                    size_t count = clamp<size_t>((1 << 24) / market.size(), 250, 10000); // Keeps the scenarios near 128 MB
+                    vector<pair<size_t, double>> positions;
+                    vector<double> losses;
+                    RiskReport risk = RiskEngine::evaluate(user, prices, ScenarioSet::fromFactorModel(paths, count), positions, losses);
+                    cout << "Monte Carlo VaR over " << count << " paths 95%: $" << risk.var95 << " (ES $" << risk.es95 << ")"
+                         << " | 99%: $" << risk.var99 << " (ES $" << risk.es99 << ")\n";
+                }
                 break;
-            case 5:
+            case 5: {
                 cout << "Simulating next day...\n";
 
-                for (auto& s : market) s->updatePrice(); // Update prices of all stocks in the market
-                user.updatePrices(); // Update prices of all stocks owned by the user
+                {
+                    STOCKSIM_TRACE("tick");
+                    if (replay) { // Next recorded day
+                        try {
+                            if (!replay->advance(market)) {
+                                cout << "Replay finished, prices stay unchanged.\n";
+                                break;
+                            }
+                        } catch (const exception& e) {
+                            cout << "Replay stopped: " << e.what() << ", prices stay unchanged.\n";
+                            replay.reset(); // Later days are simulated
+                            break;
+                        }
+                    } else if (sharded) { // Every shard ticks its own stocks in parallel
+                        sharded->tick();
+                        sharded->wait();
+                    } else if (events) { // All events up to the next session close
+                        events->runDay();
+                        for (const auto& fill : events->takeFills()) {
+                            const string& name = market[fill.instrument]->getName();
+                            if (fill.status == TradeStatus::Ok)
+                                cout << (fill.quantity > 0 ? "Bought " : "Sold ") << abs(fill.quantity) << " " << name << " at $" << fill.price << "\n";
+                            else if (fill.status == TradeStatus::InsufficientBalance) cout << "Order for " << name << " not filled: insufficient balance.\n";
+                            else cout << "Order for " << name << " not filled: not enough quantity.\n";
+                        }
+                    } else if (intraday) { // Many ticks per stock, only the close is kept in the history
+                        intraday->simulateDay(market);
+                    } else if (factorModel) { // Correlated moves for the whole market
+                        factorModel->tick(market);
+                    } else {
+                        for (auto& s : market) s->updatePrice(); // Update prices of all stocks in the market
+                    }
+                }
+                {
+                    STOCKSIM_TRACE("analytics");
+                    board.publish(market, ++day); // Make the new day visible to readers
+                    board.snapshot(prices);
+                    indicators.update(prices);
+                    covariance.update(prices);
+                    indices.update(prices);
+                    if (publisher) publisher->publish(prices, day);
+                    if (shared) shared->publish(prices, day);
+                }
+                user.markToMarket(prices.data(), prices.size()); // Owned positions follow the published day instead of moving on their own
                 cout << "Changes simulated! Here's your updated portfolio:\n";
                 user.display(); // Display the updated portfolio after simulating the next day
                 break;
+            }
+            case 6:
+                cout << "\n~ Indicators (" << indicators.getWindow() << "-day window) ~\n";
+                for (size_t i = 0; i < market.size(); ++i) { // Display indicators of each stock
+                    cout << setw(2) << market[i]->getId() << ". " << setw(12) << market[i]->getName()
+                         << " | SMA " << setw(8) << indicators.sma(i) << " | EMA " << setw(8) << indicators.getEma(i)
+                         << " | RSI " << setw(6) << indicators.rsi(i) << " | Vol " << setw(6) << indicators.volatility(i) * 100 << "%"
+                         << " | Bands " << indicators.bollingerLower(i) << "-" << indicators.bollingerUpper(i)
+                         << " | Range " << indicators.windowMin(i) << "-" << indicators.windowMax(i) << "\n";
+                }
+                break;
+            case 7: {
+                PriceTable history = PriceTable::fromHistory(market); // Replay the simulated days
+                vector<function<unique_ptr<Strategy>()>> runs = {[] { return make_unique<BuyAndHoldStrategy>(); }};
+                for (size_t fast = 2; fast <= 5; ++fast) // Grid of moving average windows
+                    for (size_t slow = fast + 2; slow <= 20; slow += 3)
+                        runs.push_back([=] { return make_unique<MovingAverageCrossStrategy>(fast, slow); });
+                vector<BacktestResult> results = Backtester(history, market).run(runs); // Fixed capital, the user's cash may be spent
+                cout << "\n~ Backtest over " << history.dayCount() << " days from $" << Backtester::defaultCapital << " ~\n";
+                for (const auto& r : results) // Display each run
+                    cout << setw(16) << r.name << " | Final $" << setw(9) << r.finalValue << " | Return " << setw(7) << r.totalReturn * 100
+                         << "% | Drawdown " << setw(6) << r.maxDrawdown * 100 << "% | Trades " << r.trades << "\n";
+                cout << "Best: " << Backtester::best(results).name << "\n";
+                break;
+            }
+            case 8: {
+                board.snapshot(prices);
+                RebalancePlan plan = Rebalancer(Rebalancer::equalWeights(market.size(), 0.95)).plan(user, prices); // Keep 5% in cash
+                for (const auto& t : plan.trades)
+                    cout << (t.quantity > 0 ? "Buy " : "Sell ") << abs(t.quantity) << " " << market[t.slot]->getName() << " at $" << prices[t.slot] << "\n";
+                size_t filled = Rebalancer::applyTrades(user, plan, market, prices);
+                cout << "Filled " << filled << " of " << plan.trades.size() << " trades | Tracking error " << plan.trackingErrorBefore * 100
+                     << "% -> " << plan.trackingErrorAfter * 100 << "% | Est. cost $" << plan.estimatedCost << "\n";
+                break;
+            }
+            case 9: {
+                PriceTable history = PriceTable::fromHistory(market);
+                if (history.dayCount() < 3) { // Covariance needs at least two returns
+                    cout << "Simulate a few days first.\n";
+                    break;
+                }
+                MeanVarianceOptimizer optimizer = MeanVarianceOptimizer::fromHistory(history);
+                cout << "\n~ Efficient frontier (daily) ~\n";
+                for (const auto& p : optimizer.frontier(6))
+                    cout << "Return " << setw(7) << p.expectedReturn * 100 << "% | Volatility " << setw(6) << p.volatility * 100 << "% | Sharpe " << p.sharpe << "\n";
+                FrontierPoint best = optimizer.maxSharpe();
+                cout << "Max Sharpe " << best.sharpe << " weights:\n";
+                for (size_t i = 0; i < market.size(); ++i)
+                    if (best.weights[i] >= 0.005) cout << "  " << setw(12) << market[i]->getName() << " " << setw(6) << best.weights[i] * 100 << "%\n";
+                break;
+            }
+            case 10: {
+                int id;
+                char type;
+                double value;
+                cout << "Enter stock ID: ";
+                cin >> id;
+                cout << "Split (s) or dividend (d): ";
+                cin >> type;
+                cout << (type == 's' ? "New shares per old share: " : "Dividend per share: ");
+                cin >> value;
+                if (id < 1 || id > (int)market.size() || value <= 0 || (type != 's' && type != 'd')) {
+                    cout << "Invalid action.\n";
+                    break;
+                }
+                SimulatedStock* stock = market[id - 1];
+                if (events) { // Goes ex at the next open, between the ticks like any other event
+                    events->schedule({type == 's' ? SimEvent::Split : SimEvent::Dividend, (uint32_t)(id - 1), events->nextOpen(), 0, value});
+                    cout << stock->getName() << (type == 's' ? " splits" : " goes ex-dividend") << " when the next day opens.\n";
+                    break;
+                }
+                double before = stock->getPrice();
+                if (type == 's') {
+                    stock->applySplit(value);
+                    user.applySplit(stock->getId(), value, stock->getPrice());
+                } else {
+                    stock->applyDividend(value);
+                    user.applyDividend(stock->getId(), value);
+                }
+                corporateAction(id - 1, stock->getPrice() / before, type == 's' ? value : 0.0);
+                board.publish(market, day);
+                cout << stock->getName() << " now trades at $" << stock->getPrice() << "\n";
+                break;
+            }
+            case 11: { // Sell out of one named lot instead of the relief order
+                int id, qty;
+                uint32_t lot;
+                cout << "Enter stock ID: ";
+                cin >> id;
+                const UserOwnedStock* position = nullptr;
+                for (const auto& stock : user.getOwnedStocks())
+                    if (stock->getId() == id) position = stock;
+                if (!position) {
+                    cout << "Stock not found in portfolio.\n";
+                    break;
+                }
+                position->forEachLot([](const TaxLot& l) {
+                    cout << "Lot " << l.id << ": " << l.quantity << " @ $" << fixed << setprecision(2) << Price::fromTicks(l.cost) << "\n";
+                });
+                cout << "Enter lot: ";
+                cin >> lot;
+                cout << "Enter quantity: ";
+                cin >> qty;
+                if (qty <= 0 || user.applySellLot(id, lot, qty, position->getPrice()) != TradeStatus::Ok)
+                    cout << "Not enough quantity in that lot.\n";
+                break;
+            }
+            case 12: { // Latest session at the coarsest intraday resolution, then the daily bars kept
+                if (!intraday || intraday->daysKept() == 0) {
+                    cout << "No intraday bars yet, run with --intraday <ticks> and simulate a day.\n";
+                    break;
+                }
+                int id;
+                cout << "Enter stock ID: ";
+                cin >> id;
+                if (id < 1 || id > (int)market.size()) {
+                    cout << "Invalid ID.\n";
+                    break;
+                }
+                auto show = [&](const string& label, const Bar& b) {
+                    cout << setw(8) << label << " | O " << setw(8) << b.open << " | H " << setw(8) << b.high << " | L " << setw(8) << b.low
+                         << " | C " << setw(8) << b.close << " | Vol " << b.volume << "\n";
+                };
+                cout << fixed << setprecision(2);
+                size_t daily = intraday->resolutionCount() - 1; // Resolutions are kept in the order given, the session comes last
+                if (intraday->resolutionCount() > 1) {
+                    size_t r = daily - 1;
+                    cout << "\n~ " << market[id - 1]->getName() << ", last session in " << intraday->resolution(r) / 60 << "-minute bars ~\n";
+                    for (size_t b = 0; b < intraday->bucketCount(r); ++b) {
+                        uint32_t minute = 9 * 60 + 30 + (uint32_t)(b * intraday->resolution(r) / 60);
+                        char clock[16];
+                        snprintf(clock, sizeof clock, "%02u:%02u", minute / 60, minute % 60);
+                        show(clock, intraday->bar(r, 0, b, id - 1));
+                    }
+                }
+                cout << "\n~ Daily bars, oldest first ~\n";
+                for (size_t ago = intraday->daysKept(); ago-- > 0;)
+                    show("Day " + to_string(day - ago), intraday->bar(daily, ago, 0, id - 1));
+                break;
+            }
             case 0:
                 cout << "Goodbye! Please return later!\n";
                 break;
@@ -252,7 +4880,29 @@ int main() {
                 cout << "Invalid option.\n";
         }
     } while (choice != 0);
+    settleOrders();
 
+    sharded.reset(); // Stop shard threads before their stocks are deleted
+#ifndef STOCKSIM_NO_METRICS
+    if (!metricsFile.empty()) { // Export timings of the session
+        ofstream out(metricsFile);
+        MetricsRegistry::instance().writePrometheus(out);
+        MetricsRegistry::instance().dumpText(cout);
+    }
+#endif
+#ifndef STOCKSIM_NO_TRACE
+    if (!traceFile.empty()) { // Timeline for chrome://tracing or Perfetto
+        ofstream out(traceFile);
+        TraceRecorder::instance().writeChromeTrace(out);
+    }
+#endif
+    if (!recordFile.empty()) { // Save the session's prices for a later replay
+        try {
+            ReplayFeed::record(PriceTable::fromHistory(market), recordFile);
+        } catch (const exception& e) {
+            cout << "Could not record prices: " << e.what() << "\n";
+        }
+    }
     for (auto s : market) // Clean up dynamically allocated memory for market stocks
         delete s;
 